@@ -6,14 +6,35 @@
 #include "azureplugin_internal.h"
 
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <assert.h>
+#include <chrono>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <exception>
 #include <fstream>
+#include <iomanip>
+#include <functional>
+#include <future>
+#include <initializer_list>
 #include <iostream>
 #include <iterator>
 #include <limits>
 #include <limits.h>
+#include <list>
 #include <memory>
+#include <mutex>
+#include <random>
 #include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 
 #include "spdlog/spdlog.h"
 
@@ -25,6 +46,19 @@
 
 #include <azure/identity/default_azure_credential.hpp>
 
+#ifdef __unix_or_mac__
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#endif
+
 using namespace azureplugin;
 
 constexpr const char *version = "0.1.0";
@@ -32,7 +66,10 @@ constexpr const char *driver_name = "Azure driver";
 constexpr const char *driver_scheme = "https";
 constexpr long long preferred_buffer_size = 4 * 1024 * 1024;
 
-bool bIsConnected = false;
+std::atomic<bool> bIsConnected{false};
+
+// Serializes driver_connect and driver_disconnect, which (re)configure the globals used by the other calls
+std::mutex connectionMutex;
 
 
 
@@ -54,8 +91,8 @@ std::string GetConnectionString() { return std::getenv("AZURE_STORAGE_CONNECTION
 // Global bucket name
 std::string globalBucketName;
 
-// Last error
-std::string lastError;
+// Last error, per thread: driver_getlasterror reports the error of the calling thread's last failed call
+thread_local std::string lastError;
 
 HandleContainer active_handles;
 
@@ -74,166 +111,160 @@ if (!(arg))                                         \
     return (err_val);                               \
 }                                                   \
 
-void LogError(const std::string &msg)
+// Driver entry points timed by the statistics
+enum class DriverOp
 {
-    lastError = msg;
-    spdlog::error(lastError);
-}
+    kExist,
+    kFileExists,
+    kDirExists,
+    kGetFileSize,
+    kFopen,
+    kFclose,
+    kFseek,
+    kFread,
+    kFwrite,
+    kFflush,
+    kRemove,
+    kRmdir,
+    kMkdir,
+    kDiskFreeSpace,
+    kCopyToLocal,
+    kCopyFromLocal,
+    kCount
+};
 
-#define LogBadStatus(a, b)
+constexpr const char *driver_op_names[] = {"exist", "fileExists", "dirExists", "getFileSize", "fopen", "fclose",
+                                           "fseek", "fread", "fwrite", "fflush", "remove", "rmdir", "mkdir",
+                                           "diskFreeSpace", "copyToLocal", "copyFromLocal"};
 
-/*
-void LogBadStatus(const gc::Status &status, const std::string &msg)
-{
-    std::ostringstream os;
-    os << msg << ": " << status;
-    LogError(os.str());
-}
-*/
-void InitHandle(Handle &h, ReaderPtr &&r_ptr)
+// HTTP methods timed by the statistics
+enum class HttpVerb
 {
-    h.var.reader = std::move(r_ptr);
-}
+    kGet,
+    kHead,
+    kPut,
+    kPost,
+    kDelete,
+    kPatch,
+    kOther,
+    kCount
+};
 
-void InitHandle(Handle &h, WriterPtr &&w_ptr)
-{
-    h.var.writer = std::move(w_ptr);
-}
+constexpr const char *http_verb_names[] = {"GET", "HEAD", "PUT", "POST", "DELETE", "PATCH", "OTHER"};
 
-template <typename VariantPtr, HandleType Type>
-HandlePtr MakeHandleFromVariant(VariantPtr &&var_ptr)
+struct OpStats
 {
-    HandlePtr h{new Handle(Type)};
-    InitHandle(*h, std::move(var_ptr));
-    return h;
-}
+    LatencyHistogram latency;
+    std::atomic<uint64_t> errors{0};
+};
 
-template <typename VariantPtr, HandleType Type>
-Handle *InsertHandle(VariantPtr &&var_ptr)
+// Process-wide statistics of the driver since it was loaded. Every update is a relaxed atomic increment,
+// cheap enough to leave the statistics always on.
+struct DriverStats
 {
-    return active_handles.insert(active_handles.end(),
-                                 MakeHandleFromVariant<VariantPtr, Type>(std::move(var_ptr)))
-        ->get();
-}
+    std::array<OpStats, static_cast<size_t>(DriverOp::kCount)> ops;
+    // every attempt of the HTTP requests, retries included
+    std::array<OpStats, static_cast<size_t>(HttpVerb::kCount)> http;
+    // HTTP requests before retries, the retries are the attempts in excess
+    std::atomic<uint64_t> http_operations{0};
+    std::atomic<uint64_t> http_bytes_in{0};
+    std::atomic<uint64_t> http_bytes_out{0};
+    std::atomic<uint64_t> bytes_read{0};
+    std::atomic<uint64_t> bytes_written{0};
+    std::atomic<uint64_t> metadata_cache_hits{0};
+    std::atomic<uint64_t> metadata_cache_misses{0};
+    std::atomic<uint64_t> manifest_cache_hits{0};
+    std::atomic<uint64_t> manifest_cache_misses{0};
+    std::atomic<uint64_t> block_cache_hits{0};
+    std::atomic<uint64_t> disk_cache_hits{0};
+    std::atomic<uint64_t> block_cache_misses{0};
+};
 
-HandleIt FindHandle(void *handle)
+DriverStats stats;
+
+void CountStat(std::atomic<uint64_t> &counter, uint64_t n = 1)
 {
-    return std::find_if(active_handles.begin(), active_handles.end(), [handle](const HandlePtr &act_h_ptr)
-                        { return handle == static_cast<void *>(act_h_ptr.get()); });
+    counter.fetch_add(n, std::memory_order_relaxed);
 }
 
-void EraseRemove(HandleIt pos)
+uint64_t NanosecondsSince(std::chrono::steady_clock::time_point start)
 {
-    *pos = std::move(active_handles.back());
-    active_handles.pop_back();
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
 }
 
-// Definition of helper functions
-/*
-gc::StatusOr<long long int> DownloadFileRangeToBuffer(const std::string &bucket_name,
-                                                      const std::string &object_name,
-                                                      char *buffer,
-                                                      std::int64_t start_range,
-                                                      std::int64_t end_range)
+// Entry point running on this thread, the errors it logs are counted against it
+thread_local DriverOp current_op{DriverOp::kCount};
+
+// Times a driver entry point from construction to destruction
+class OpTimer
 {
-    auto reader = client.ReadObject(bucket_name, object_name, gcs::ReadRange(start_range, end_range));
-    if (!reader)
+public:
+    explicit OpTimer(DriverOp op)
+        : op_(op), outer_op_(current_op), start_(std::chrono::steady_clock::now())
     {
-        auto &o_status = reader.status();
-        return gc::Status{o_status.code(), "Error while creating reading stream; " + o_status.message()};
+        current_op = op;
     }
 
-    reader.read(buffer, end_range - start_range);
-    if (reader.bad())
+    ~OpTimer()
     {
-        auto &o_status = reader.status();
-        return gc::Status{o_status.code(), "Error while creating reading stream; " + o_status.message()};
+        stats.ops[static_cast<size_t>(op_)].latency.Record(NanosecondsSince(start_));
+        current_op = outer_op_;
     }
 
-    long long int num_read = static_cast<long long>(reader.gcount());
-    spdlog::debug("read = {}", num_read);
+    OpTimer(const OpTimer &) = delete;
+    OpTimer &operator=(const OpTimer &) = delete;
 
-    return num_read;
-}
+private:
+    DriverOp op_;
+    DriverOp outer_op_;
+    std::chrono::steady_clock::time_point start_;
+};
 
-gc::StatusOr<long long> ReadBytesInFile(MultiPartFile &multifile, char *buffer, tOffset to_read)
+void LogError(const std::string &msg)
 {
-    // Start at first usable file chunk
-    // Advance through file chunks, advancing buffer pointer
-    // Until last requested byte was read
-    // Or error occured
-
-    tOffset bytes_read{0};
-
-    // Lookup item containing initial bytes at requested offset
-    const auto &cumul_sizes = multifile.cumulativeSize_;
-    const tOffset common_header_length = multifile.commonHeaderLength_;
-    const std::string &bucket_name = multifile.bucketname_;
-    const auto &filenames = multifile.filenames_;
-    char *buffer_pos = buffer;
-    tOffset &offset = multifile.offset_;
-    const tOffset offset_bak = offset; // in case of irrecoverable error, leave the multifile in its starting state
-
-    auto greater_than_offset_it = std::upper_bound(cumul_sizes.begin(), cumul_sizes.end(), offset);
-    size_t idx = static_cast<size_t>(std::distance(cumul_sizes.begin(), greater_than_offset_it));
-
-    spdlog::debug("Use item {} to read @ {} (end = {})", idx, offset, *greater_than_offset_it);
-
-    auto read_range_and_update = [&](const std::string &filename, tOffset start, tOffset end) -> gc::Status
+    if (DriverOp::kCount != current_op)
     {
-        auto maybe_actual_read = DownloadFileRangeToBuffer(bucket_name, filename, buffer_pos,
-                                                           static_cast<int64_t>(start), static_cast<int64_t>(end));
-        if (!maybe_actual_read)
-        {
-            offset = offset_bak;
-            RETURN_STATUS(maybe_actual_read);
-        }
-
-        tOffset actual_read = *maybe_actual_read;
-
-        bytes_read += actual_read;
-        buffer_pos += actual_read;
-        offset += actual_read;
-
-        if (actual_read < (end - start))
-        {
-            spdlog::debug("End of file encountered");
-            to_read = 0;
-        }
-        else
-        {
-            to_read -= actual_read;
-        }
-
-        return {};
-    };
+        CountStat(stats.ops[static_cast<size_t>(current_op)].errors);
+    }
+    lastError = msg;
+    spdlog::error(lastError);
+}
 
-    // first file read
+void LogBadStatus(const std::exception &e, const std::string &msg)
+{
+    std::ostringstream os;
+    os << msg << ": " << e.what();
+    LogError(os.str());
+}
 
-    const tOffset file_start = (idx == 0) ? offset : offset - cumul_sizes[idx - 1] + common_header_length;
-    const tOffset read_end = std::min(file_start + to_read, file_start + cumul_sizes[idx] - offset);
+void InitHandle(Handle &h, ReaderPtr &&r_ptr)
+{
+    h.var.reader = std::move(r_ptr);
+}
 
-    gc::Status read_status = read_range_and_update(filenames[idx], file_start, read_end);
+void InitHandle(Handle &h, WriterPtr &&w_ptr)
+{
+    h.var.writer = std::move(w_ptr);
+}
 
-    // continue with the next files
-    while (read_status.ok() && to_read)
-    {
-        // read the missing bytes in the next files as necessary
-        idx++;
-        const tOffset start = common_header_length;
-        const tOffset end = std::min(start + to_read, start + cumul_sizes[idx] - cumul_sizes[idx - 1]);
+template <typename VariantPtr, HandleType Type>
+HandlePtr MakeHandleFromVariant(VariantPtr &&var_ptr)
+{
+    HandlePtr h = std::make_shared<Handle>(Type);
+    InitHandle(*h, std::move(var_ptr));
+    return h;
+}
 
-        read_status = read_range_and_update(filenames[idx], start, end);
-    }
+template <typename VariantPtr, HandleType Type>
+void *InsertHandle(VariantPtr &&var_ptr)
+{
+    return active_handles.Insert(MakeHandleFromVariant<VariantPtr, Type>(std::move(var_ptr)));
+}
 
-    return read_status.ok() ? bytes_read : gc::StatusOr<long long>{read_status};
+HandlePtr FindHandle(void *handle)
+{
+    return active_handles.Find(handle);
 }
-*/
-enum Service {
-  UNKNOWN = 0,
-  BLOB,
-  SHARE
-};
 
 struct ParseUriResult
 {
@@ -349,232 +380,3469 @@ std::string GetEnvironmentVariableOrDefault(const std::string &variable_name,
     return default_value;
 }
  
-BlobServiceClient GetBlobServiceClient() {
-    // TODO Should allow different auth options like described in: https://learn.microsoft.com/en-us/azure/storage/blobs/authorize-data-operations-cli
+long long GetEnvironmentVariableAsLongOrDefault(const std::string &variable_name, long long default_value)
+{
+    const std::string value = GetEnvironmentVariableOrDefault(variable_name, std::to_string(default_value));
 
-    std::string connectionString = GetEnvironmentVariableOrDefault(
-        "AZURE_STORAGE_CONNECTION_STRING",
-        "DefaultEndpointsProtocol=http;AccountName=devstoreaccount1;AccountKey=Eby8vdM02xNOcqFlqUwJPLlmEtlCDXJ1OUzFT50uSRZ6IFsuFq2UVErCz4I6tq/K1SZFPTOtr/KBHBeksoGMGw==;BlobEndpoint=http://127.0.0.1:10000/devstoreaccount1;"
-    );
-    return BlobServiceClient::CreateFromConnectionString(connectionString);
+    char *end = nullptr;
+    const long long parsed = std::strtoll(value.c_str(), &end, 10);
+    if (end == value.c_str() || *end != '\0' || parsed < 0)
+    {
+        spdlog::warn("Invalid value '{}' for {}, using {} as default.", value, variable_name, default_value);
+        return default_value;
+    }
+    return parsed;
 }
 
-ShareServiceClient GetShareServiceClient() {
+std::string GetConnectionStringOrDefault()
+{
     // TODO Should allow different auth options like described in: https://learn.microsoft.com/en-us/azure/storage/blobs/authorize-data-operations-cli
-
-    std::string connectionString = GetEnvironmentVariableOrDefault(
+    return GetEnvironmentVariableOrDefault(
         "AZURE_STORAGE_CONNECTION_STRING",
         "DefaultEndpointsProtocol=http;AccountName=devstoreaccount1;AccountKey=Eby8vdM02xNOcqFlqUwJPLlmEtlCDXJ1OUzFT50uSRZ6IFsuFq2UVErCz4I6tq/K1SZFPTOtr/KBHBeksoGMGw==;BlobEndpoint=http://127.0.0.1:10000/devstoreaccount1;"
     );
-    return ShareServiceClient::CreateFromConnectionString(connectionString);
 }
 
-bool WillSizeCountProductOverflow(size_t size, size_t count)
+HttpVerb ToHttpVerb(const Azure::Core::Http::HttpMethod &method)
 {
-    constexpr size_t max_prod_usable{static_cast<size_t>(std::numeric_limits<tOffset>::max())};
-    return (max_prod_usable / size < count || max_prod_usable / count < size);
+    using Azure::Core::Http::HttpMethod;
+    if (method == HttpMethod::Get)
+        return HttpVerb::kGet;
+    if (method == HttpMethod::Head)
+        return HttpVerb::kHead;
+    if (method == HttpMethod::Put)
+        return HttpVerb::kPut;
+    if (method == HttpMethod::Post)
+        return HttpVerb::kPost;
+    if (method == HttpMethod::Delete)
+        return HttpVerb::kDelete;
+    if (method == HttpMethod::Patch)
+        return HttpVerb::kPatch;
+    return HttpVerb::kOther;
 }
 
-/*
-gc::StatusOr<gcs::ListObjectsReader> ListObjects(const std::string &bucket_name, const std::string &object_name)
+// Counts the requests of the driver once each, ahead of the retry policy of the clients
+class OperationStatsPolicy final : public Azure::Core::Http::Policies::HttpPolicy
 {
-    auto list = client.ListObjects(bucket_name, gcs::MatchGlob{object_name});
-    auto first = list.begin();
-    if (first == list.end())
-    {
-        return gc::Status{gc::StatusCode::kNotFound, "Error while searching object : not found"};
-    }
-    if (!first->ok())
+public:
+    std::unique_ptr<Azure::Core::Http::RawResponse> Send(Azure::Core::Http::Request &request,
+                                                         Azure::Core::Http::Policies::NextHttpPolicy next_policy,
+                                                         const Azure::Core::Context &context) const override
     {
-        return std::move(*first).status();
+        CountStat(stats.http_operations);
+        return next_policy.Send(request, context);
     }
-    return list;
-}
-*/
-/*
-// pre condition: stream is of a writing type. do not call otherwise.
-gc::Status CloseWriterStream(Handle &stream)
-{
-    gc::StatusOr<gcs::ObjectMetadata> maybe_meta;
-    std::ostringstream err_msg_os;
 
-    // close the stream to flush all remaining bytes in the put area
-    auto &writer = stream.GetWriter().writer_;
-    writer.Close();
-    maybe_meta = writer.metadata();
-    if (!maybe_meta)
+    std::unique_ptr<HttpPolicy> Clone() const override
     {
-        err_msg_os << "Error during upload";
+        return std::unique_ptr<HttpPolicy>(new OperationStatsPolicy(*this));
     }
-    else if (HandleType::kAppend == stream.type)
-    {
-        // the tmp file is valid and ready for composition with the source
-        const auto &writer_h = stream.GetWriter();
-        const std::string &bucket = writer_h.bucketname_;
-        const std::string &append_source = writer_h.filename_;
-        const std::string &dest = writer_h.append_target_;
-        std::vector<gcs::ComposeSourceObject> source_objects = {{dest, {}, {}}, {append_source, {}, {}}};
-        maybe_meta = client.ComposeObject(bucket, std::move(source_objects), dest);
+};
 
-        // whatever happened, delete the tmp file
-        gc::Status delete_status = client.DeleteObject(bucket, append_source);
+// Times each attempt of a request, retries included, until the response headers are received, and counts
+// the bytes sent and the bytes announced by the responses
+class AttemptStatsPolicy final : public Azure::Core::Http::Policies::HttpPolicy
+{
+public:
+    std::unique_ptr<Azure::Core::Http::RawResponse> Send(Azure::Core::Http::Request &request,
+                                                         Azure::Core::Http::Policies::NextHttpPolicy next_policy,
+                                                         const Azure::Core::Context &context) const override
+    {
+        const HttpVerb verb = ToHttpVerb(request.GetMethod());
+        OpStats &verb_stats = stats.http[static_cast<size_t>(verb)];
+        CountStat(stats.http_bytes_out, static_cast<uint64_t>(std::max<int64_t>(0, request.GetBodyStream()->Length())));
 
-        // TODO: what to do with an error on Delete?
-        (void)delete_status;
+        const auto start = std::chrono::steady_clock::now();
+        std::unique_ptr<Azure::Core::Http::RawResponse> response;
+        try
+        {
+            response = next_policy.Send(request, context);
+        }
+        catch (...)
+        {
+            verb_stats.latency.Record(NanosecondsSince(start));
+            CountStat(verb_stats.errors);
+            throw;
+        }
+        verb_stats.latency.Record(NanosecondsSince(start));
 
-        // if composition failed, nothing is written, the source did not change. signal it
-        if (!maybe_meta)
+        if (static_cast<int>(response->GetStatusCode()) >= 400)
         {
-            err_msg_os << "Error while uploading the data to append";
+            CountStat(verb_stats.errors);
         }
+        const auto &headers = response->GetHeaders();
+        const auto content_length = headers.find("content-length");
+        if (HttpVerb::kHead != verb && content_length != headers.end())
+        {
+            CountStat(stats.http_bytes_in, std::strtoull(content_length->second.c_str(), nullptr, 10));
+        }
+        return response;
     }
 
-    if (maybe_meta)
+    std::unique_ptr<HttpPolicy> Clone() const override
     {
-        return {};
+        return std::unique_ptr<HttpPolicy>(new AttemptStatsPolicy(*this));
     }
+};
 
-    const gc::Status &status = maybe_meta.status();
-    err_msg_os << ": " << maybe_meta.status().message();
-    return gc::Status{status.code(), err_msg_os.str()};
-}
-*/
-// Implementation of driver functions
-/*
-void test_setClient(::google::cloud::storage::Client &&mock_client)
-{
-    client = std::move(mock_client);
-    bIsConnected = kTrue;
-}
-
-void test_unsetClient()
-{
-    client = ::google::cloud::storage::Client{};
-}
-
-void *test_getActiveHandles()
-{
-    return &active_handles;
-}
-
-void *test_addReaderHandle(
-    const std::string &bucket,
-    const std::string &object,
-    long long offset,
-    long long commonHeaderLength,
-    const std::vector<std::string> &filenames,
-    const std::vector<long long int> &cumulativeSize,
-    long long total_size)
-{
-    ReaderPtr reader_ptr{new MultiPartFile{
-        bucket,
-        object,
-        offset,
-        commonHeaderLength,
-        filenames,
-        cumulativeSize,
-        total_size}};
-    return InsertHandle<ReaderPtr, HandleType::kRead>(std::move(reader_ptr));
-}
+// Stream handle on whose behalf the calling thread works, reported by the traces
+thread_local const void *trace_handle{nullptr};
 
-void *test_addWriterHandle(bool appendMode, bool create_with_mock_client, std::string bucketname, std::string objectname)
+// Sets the traced handle of the calling thread for the duration of a call
+class TraceHandleScope
 {
-    if (!create_with_mock_client)
-    {
-        if (appendMode)
-        {
-            return InsertHandle<WriterPtr, HandleType::kAppend>(WriterPtr(new WriteFile));
-        }
-        return InsertHandle<WriterPtr, HandleType::kWrite>(WriterPtr(new WriteFile));
-    }
-
-    auto writer = client.WriteObject(bucketname, objectname);
-    if (!writer)
+public:
+    explicit TraceHandleScope(const void *handle)
+        : outer_handle_(trace_handle)
     {
-        return nullptr;
+        trace_handle = handle;
     }
 
-    WriterPtr writer_struct{new WriteFile};
-    writer_struct->bucketname_ = std::move(bucketname);
-    writer_struct->filename_ = std::move(objectname);
-    writer_struct->writer_ = std::move(writer);
-
-    if (appendMode)
+    ~TraceHandleScope()
     {
-        return InsertHandle<WriterPtr, HandleType::kAppend>(std::move(writer_struct));
+        trace_handle = outer_handle_;
     }
-    return InsertHandle<WriterPtr, HandleType::kWrite>(std::move(writer_struct));
-}
-*/
-const char *driver_getDriverName()
-{
-    return driver_name;
-}
 
-const char *driver_getVersion()
-{
-    return version;
-}
+    TraceHandleScope(const TraceHandleScope &) = delete;
+    TraceHandleScope &operator=(const TraceHandleScope &) = delete;
 
-const char *driver_getScheme()
-{
-    return driver_scheme;
-}
+private:
+    const void *outer_handle_;
+};
 
-int driver_isReadOnly()
+// One attempt of an HTTP request, as a complete event of the Chrome trace format
+struct TraceEvent
 {
-    return kFalse;
-}
+    std::string name;
+    std::string path;
+    std::string range;
+    const void *handle{nullptr};
+    uint32_t thread{0};
+    int attempt{0};
+    int status{0};
+    // nanoseconds since the tracer was enabled
+    uint64_t issued{0};  // the request was issued by the driver, before any retry
+    uint64_t sent{0};    // this attempt was handed to the transport
+    uint64_t headers{0}; // the response headers, hence its first bytes, were received
+    uint64_t done{0};    // the body of the response was read or dropped
+};
 
-int driver_connect()
+// Optional timeline of the HTTP requests, enabled by AZURE_DRIVER_TRACE_FILE and written there at
+// disconnection in the trace_event JSON format of chrome://tracing.
+// Each thread records its events in its own ring buffer, which keeps the last ring_size events. The lock of
+// a ring is only contended while the trace is written.
+class Tracer
 {
-    const std::string loglevel = GetEnvironmentVariableOrDefault("AZURE_DRIVER_LOGLEVEL", "info");
-    if (loglevel == "debug")
-        spdlog::set_level(spdlog::level::debug);
-    else if (loglevel == "trace")
-        spdlog::set_level(spdlog::level::trace);
-    else
-        spdlog::set_level(spdlog::level::info);
-
-    spdlog::debug("Connect {}", loglevel);
+public:
+    void Configure(std::string path, size_t ring_size)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        path_ = std::move(path);
+        ring_size_ = std::max<size_t>(1, ring_size);
+        rings_.clear();
+        generation_++;
+        start_ = std::chrono::steady_clock::now();
+        enabled_.store(!path_.empty(), std::memory_order_release);
+    }
 
-    // Initialize variables from environment
-    globalBucketName = GetEnvironmentVariableOrDefault("AZURE_BUCKET_NAME", "");
+    bool IsEnabled() const
+    {
+        return enabled_.load(std::memory_order_acquire);
+    }
 
-    // Tester la connexion
-    try {
-        auto blobServiceClient = GetBlobServiceClient();
-        auto properties = blobServiceClient.GetProperties();
-        std::cout << "Connexion valide." << std::endl;
-        bIsConnected = true;
-        return kSuccess;
-    } catch (const std::exception& e) {
-        std::cerr << "Erreur de connexion : " << e.what() << std::endl;
-        return kFailure;
+    uint64_t Now() const
+    {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start_).count());
     }
-/*
-    gc::Options options{};
 
-    // Add project ID if defined
-    std::string project = GetEnvironmentVariableOrDefault("CLOUD_ML_PROJECT_ID", "");
-    if (!project.empty())
+    // Numbers the calling thread in the trace
+    uint32_t ThreadId()
     {
-        options.set<gc::UserProjectOption>(std::move(project));
+        return LocalRing().thread;
     }
 
-    std::string gcp_token_filename = GetEnvironmentVariableOrDefault("GCP_TOKEN", "");
-    if (!gcp_token_filename.empty())
+    void Record(TraceEvent &&event)
     {
-        // Initialize from token file
-        std::ifstream t(gcp_token_filename);
-        std::stringstream buffer;
-        buffer << t.rdbuf();
-        if (t.fail())
+        if (!IsEnabled())
         {
-            LogError("Error initializing token from file");
-            return kFailure;
+            return;
         }
-        std::shared_ptr<gc::Credentials> creds = gc::MakeServiceAccountCredentials(buffer.str());
+        Ring &ring = LocalRing();
+        std::lock_guard<std::mutex> lock(ring.mutex);
+        if (ring.events.size() < ring_size_)
+        {
+            ring.events.push_back(std::move(event));
+        }
+        else
+        {
+            ring.events[ring.next] = std::move(event);
+        }
+        ring.next = (ring.next + 1) % ring_size_;
+    }
+
+    // Writes the events recorded since Configure and disables the tracer
+    void Write()
+    {
+        std::vector<std::shared_ptr<Ring>> rings;
+        std::string path;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!enabled_.exchange(false))
+            {
+                return;
+            }
+            rings.swap(rings_);
+            path = path_;
+            generation_++;
+        }
+
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+        bool first{true};
+        for (const auto &ring : rings)
+        {
+            std::lock_guard<std::mutex> lock(ring->mutex);
+            for (const auto &event : ring->events)
+            {
+                out << (first ? "\n" : ",\n");
+                WriteEvent(out, event);
+                first = false;
+            }
+        }
+        out << "\n]}\n";
+        if (!out)
+        {
+            spdlog::warn("Failed to write the request trace to {}", path);
+        }
+    }
+
+private:
+    struct Ring
+    {
+        std::mutex mutex;
+        std::vector<TraceEvent> events;
+        size_t next{0};
+        uint32_t thread{0};
+        uint64_t generation{0};
+    };
+
+    // The ring of the calling thread for the current configuration, registered on first use
+    Ring &LocalRing()
+    {
+        static thread_local std::shared_ptr<Ring> ring;
+        if (!ring || ring->generation != generation_.load(std::memory_order_acquire))
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            ring = std::make_shared<Ring>();
+            ring->thread = static_cast<uint32_t>(rings_.size() + 1);
+            ring->generation = generation_.load(std::memory_order_relaxed);
+            rings_.push_back(ring);
+        }
+        return *ring;
+    }
+
+    static void WriteString(std::ostream &os, const std::string &value)
+    {
+        os << '"';
+        for (const char c : value)
+        {
+            if ('"' == c || '\\' == c)
+            {
+                os << '\\' << c;
+            }
+            else if (static_cast<unsigned char>(c) < 0x20)
+            {
+                os << "\\u" << std::hex << std::setw(4) << std::setfill('0') << static_cast<int>(c) << std::dec;
+            }
+            else
+            {
+                os << c;
+            }
+        }
+        os << '"';
+    }
+
+    static double Microseconds(uint64_t nanoseconds)
+    {
+        return static_cast<double>(nanoseconds) / 1000.0;
+    }
+
+    static void WriteEvent(std::ostream &os, const TraceEvent &event)
+    {
+        os << std::fixed << std::setprecision(3) << "{\"ph\":\"X\",\"cat\":\"http\",\"pid\":1,\"name\":";
+        WriteString(os, event.name);
+        os << ",\"tid\":" << event.thread
+           << ",\"ts\":" << Microseconds(event.sent)
+           << ",\"dur\":" << Microseconds(event.done - event.sent)
+           << ",\"args\":{\"path\":";
+        WriteString(os, event.path);
+        if (!event.range.empty())
+        {
+            os << ",\"range\":";
+            WriteString(os, event.range);
+        }
+        std::ostringstream handle;
+        handle << event.handle;
+        os << ",\"handle\":";
+        WriteString(os, event.handle ? handle.str() : std::string());
+        os << ",\"attempt\":" << event.attempt
+           << ",\"status\":" << event.status
+           << ",\"queued_us\":" << Microseconds(event.sent - event.issued)
+           << ",\"first_byte_us\":" << Microseconds(event.headers - event.sent)
+           << "}}";
+    }
+
+    std::mutex mutex_;
+    std::atomic<bool> enabled_{false};
+    std::string path_;
+    size_t ring_size_{1};
+    std::atomic<uint64_t> generation_{0};
+    std::chrono::steady_clock::time_point start_;
+    std::vector<std::shared_ptr<Ring>> rings_;
+};
+
+Tracer tracer;
+
+// Start of a request, before the retry policy, shared by its attempts through the context
+struct TracedOperation
+{
+    uint64_t issued{0};
+    std::atomic<int> attempts{0};
+};
+
+const Azure::Core::Context::Key traced_operation_key;
+
+// Names an attempt after its method and the comp parameter of the storage services, e.g. "PUT block"
+std::string TraceEventName(const Azure::Core::Http::Request &request)
+{
+    std::string name = request.GetMethod().ToString();
+    const auto parameters = request.GetUrl().GetQueryParameters();
+    const auto comp = parameters.find("comp");
+    if (comp != parameters.end())
+    {
+        name += " " + comp->second;
+    }
+    return name;
+}
+
+// Marks the start of a traced request, ahead of the retry policy of the clients
+class TraceOperationPolicy final : public Azure::Core::Http::Policies::HttpPolicy
+{
+public:
+    std::unique_ptr<Azure::Core::Http::RawResponse> Send(Azure::Core::Http::Request &request,
+                                                         Azure::Core::Http::Policies::NextHttpPolicy next_policy,
+                                                         const Azure::Core::Context &context) const override
+    {
+        if (!tracer.IsEnabled())
+        {
+            return next_policy.Send(request, context);
+        }
+        auto operation = std::make_shared<TracedOperation>();
+        operation->issued = tracer.Now();
+        return next_policy.Send(request, context.WithValue(traced_operation_key, std::move(operation)));
+    }
+
+    std::unique_ptr<HttpPolicy> Clone() const override
+    {
+        return std::unique_ptr<HttpPolicy>(new TraceOperationPolicy(*this));
+    }
+};
+
+// Body of a traced response, which completes the event of its attempt once read to the end or dropped
+class TracedBodyStream final : public Azure::Core::IO::BodyStream
+{
+public:
+    TracedBodyStream(std::unique_ptr<Azure::Core::IO::BodyStream> body, TraceEvent event)
+        : body_(std::move(body)), event_(std::move(event))
+    {
+    }
+
+    ~TracedBodyStream() override
+    {
+        Complete();
+    }
+
+    int64_t Length() const override
+    {
+        return body_->Length();
+    }
+
+    void Rewind() override
+    {
+        body_->Rewind();
+        read_ = 0;
+    }
+
+private:
+    size_t OnRead(uint8_t *buffer, size_t count, const Azure::Core::Context &context) override
+    {
+        const size_t num_read = body_->Read(buffer, count, context);
+        read_ += static_cast<int64_t>(num_read);
+        if ((0 == num_read && count > 0) || (body_->Length() >= 0 && read_ >= body_->Length()))
+        {
+            Complete();
+        }
+        return num_read;
+    }
+
+    void Complete()
+    {
+        if (!completed_)
+        {
+            completed_ = true;
+            event_.done = tracer.Now();
+            tracer.Record(std::move(event_));
+        }
+    }
+
+    std::unique_ptr<Azure::Core::IO::BodyStream> body_;
+    TraceEvent event_;
+    int64_t read_{0};
+    bool completed_{false};
+};
+
+// Records each attempt of a request, retries included, in the trace
+class TraceAttemptPolicy final : public Azure::Core::Http::Policies::HttpPolicy
+{
+public:
+    std::unique_ptr<Azure::Core::Http::RawResponse> Send(Azure::Core::Http::Request &request,
+                                                         Azure::Core::Http::Policies::NextHttpPolicy next_policy,
+                                                         const Azure::Core::Context &context) const override
+    {
+        if (!tracer.IsEnabled())
+        {
+            return next_policy.Send(request, context);
+        }
+
+        TraceEvent event;
+        event.name = TraceEventName(request);
+        event.path = request.GetUrl().GetPath();
+        const auto headers = request.GetHeaders();
+        const auto range = headers.find("x-ms-range");
+        if (range != headers.end())
+        {
+            event.range = range->second;
+        }
+        event.handle = trace_handle;
+        event.thread = tracer.ThreadId();
+        event.sent = tracer.Now();
+        event.issued = event.sent;
+        std::shared_ptr<TracedOperation> operation;
+        if (context.TryGetValue(traced_operation_key, operation) && operation)
+        {
+            event.issued = operation->issued;
+            event.attempt = ++operation->attempts;
+        }
+
+        std::unique_ptr<Azure::Core::Http::RawResponse> response;
+        try
+        {
+            response = next_policy.Send(request, context);
+        }
+        catch (...)
+        {
+            event.headers = event.done = tracer.Now();
+            tracer.Record(std::move(event));
+            throw;
+        }
+        event.headers = tracer.Now();
+        event.status = static_cast<int>(response->GetStatusCode());
+
+        // a streamed body, e.g. of a download, is still to be read: its reader completes the event
+        auto body = response->ExtractBodyStream();
+        if (body)
+        {
+            response->SetBodyStream(std::unique_ptr<Azure::Core::IO::BodyStream>(new TracedBodyStream(std::move(body), std::move(event))));
+        }
+        else
+        {
+            event.done = event.headers;
+            tracer.Record(std::move(event));
+        }
+        return response;
+    }
+
+    std::unique_ptr<HttpPolicy> Clone() const override
+    {
+        return std::unique_ptr<HttpPolicy>(new TraceAttemptPolicy(*this));
+    }
+};
+
+// Adds the statistics and trace policies to the pipeline of a service client
+template <typename Options>
+Options MakeClientOptions()
+{
+    Options options;
+    options.PerOperationPolicies.emplace_back(new OperationStatsPolicy());
+    options.PerOperationPolicies.emplace_back(new TraceOperationPolicy());
+    options.PerRetryPolicies.emplace_back(new AttemptStatsPolicy());
+    options.PerRetryPolicies.emplace_back(new TraceAttemptPolicy());
+    return options;
+}
+
+void WriteHistogramJson(std::ostream &os, const OpStats &op_stats)
+{
+    const LatencyHistogram &latency = op_stats.latency;
+    const uint64_t count = latency.Count();
+    os << "{\"count\":" << count
+       << ",\"errors\":" << op_stats.errors.load(std::memory_order_relaxed)
+       << ",\"mean_ns\":" << (count > 0 ? latency.Sum() / count : 0)
+       << ",\"p50_ns\":" << latency.ValueAtPercentile(50)
+       << ",\"p90_ns\":" << latency.ValueAtPercentile(90)
+       << ",\"p99_ns\":" << latency.ValueAtPercentile(99)
+       << ",\"p999_ns\":" << latency.ValueAtPercentile(99.9)
+       << ",\"max_ns\":" << latency.Max()
+       << ",\"buckets\":[";
+    // non-empty buckets only, as [lowest value, count]
+    bool first{true};
+    for (size_t i = 0; i < LatencyHistogram::kBucketCount; i++)
+    {
+        const uint64_t bucket_count = latency.BucketCount(i);
+        if (bucket_count > 0)
+        {
+            os << (first ? "" : ",") << '[' << LatencyHistogram::BucketLowerBound(i) << ',' << bucket_count << ']';
+            first = false;
+        }
+    }
+    os << "]}";
+}
+
+// JSON snapshot of the statistics, taken while they keep being updated
+std::string StatsToJson()
+{
+    std::ostringstream os;
+    os << "{\"driver\":{";
+    for (size_t i = 0; i < stats.ops.size(); i++)
+    {
+        os << (i ? "," : "") << '"' << driver_op_names[i] << "\":";
+        WriteHistogramJson(os, stats.ops[i]);
+    }
+
+    os << "},\"http\":{";
+    uint64_t attempts{0};
+    for (size_t i = 0; i < stats.http.size(); i++)
+    {
+        attempts += stats.http[i].latency.Count();
+        os << (i ? "," : "") << '"' << http_verb_names[i] << "\":";
+        WriteHistogramJson(os, stats.http[i]);
+    }
+
+    const uint64_t operations = stats.http_operations.load(std::memory_order_relaxed);
+    const std::pair<const char *, uint64_t> counters[] = {
+        {"http_requests", operations},
+        {"http_retries", attempts > operations ? attempts - operations : 0},
+        {"http_bytes_in", stats.http_bytes_in.load(std::memory_order_relaxed)},
+        {"http_bytes_out", stats.http_bytes_out.load(std::memory_order_relaxed)},
+        {"bytes_read", stats.bytes_read.load(std::memory_order_relaxed)},
+        {"bytes_written", stats.bytes_written.load(std::memory_order_relaxed)},
+        {"metadata_cache_hits", stats.metadata_cache_hits.load(std::memory_order_relaxed)},
+        {"metadata_cache_misses", stats.metadata_cache_misses.load(std::memory_order_relaxed)},
+        {"manifest_cache_hits", stats.manifest_cache_hits.load(std::memory_order_relaxed)},
+        {"manifest_cache_misses", stats.manifest_cache_misses.load(std::memory_order_relaxed)},
+        {"block_cache_hits", stats.block_cache_hits.load(std::memory_order_relaxed)},
+        {"disk_cache_hits", stats.disk_cache_hits.load(std::memory_order_relaxed)},
+        {"block_cache_misses", stats.block_cache_misses.load(std::memory_order_relaxed)}};
+    os << "},\"counters\":{";
+    for (size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); i++)
+    {
+        os << (i ? "," : "") << '"' << counters[i].first << "\":" << counters[i].second;
+    }
+    os << "}}";
+    return os.str();
+}
+
+// Snapshot returned by driver_getStats, per thread as the last error
+thread_local std::string lastStats;
+
+// Writes the statistics to the file named by AZURE_DRIVER_STATS_FILE, if any
+void DumpStats()
+{
+    const std::string path = GetEnvironmentVariableOrDefault("AZURE_DRIVER_STATS_FILE", "");
+    if (path.empty())
+    {
+        return;
+    }
+
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out << StatsToJson() << '\n';
+    if (!out)
+    {
+        spdlog::warn("Failed to write the driver statistics to {}", path);
+    }
+}
+
+// Service clients, created once by driver_connect and released by driver_disconnect, so that all the calls
+// of a connection share the same HTTP pipelines, hence the same connection pools and TLS sessions.
+std::unique_ptr<BlobServiceClient> blobServiceClient;
+std::unique_ptr<ShareServiceClient> shareServiceClient;
+
+// Container clients by container name, built on demand from blobServiceClient
+std::mutex containerClientsMutex;
+std::unordered_map<std::string, BlobContainerClient> containerClients;
+
+const BlobServiceClient &GetBlobServiceClient()
+{
+    if (!blobServiceClient)
+    {
+        throw std::runtime_error("Driver is not connected");
+    }
+    return *blobServiceClient;
+}
+
+const ShareServiceClient &GetShareServiceClient()
+{
+    if (!shareServiceClient)
+    {
+        throw std::runtime_error("No file share service available for this connection");
+    }
+    return *shareServiceClient;
+}
+
+ShareFileClient GetShareFileClient(const std::string &share_name, const std::string &path)
+{
+    return GetShareServiceClient().GetShareClient(share_name).GetRootDirectoryClient().GetFileClient(path);
+}
+
+BlobContainerClient GetContainerClient(const std::string &bucket_name)
+{
+    std::lock_guard<std::mutex> lock(containerClientsMutex);
+    auto found = containerClients.find(bucket_name);
+    if (found == containerClients.end())
+    {
+        found = containerClients.emplace(bucket_name, GetBlobServiceClient().GetBlobContainerClient(bucket_name)).first;
+    }
+    return found->second;
+}
+
+void ReleaseServiceClients()
+{
+    {
+        std::lock_guard<std::mutex> lock(containerClientsMutex);
+        containerClients.clear();
+    }
+    blobServiceClient.reset();
+    shareServiceClient.reset();
+}
+
+bool WillSizeCountProductOverflow(size_t size, size_t count)
+{
+    constexpr size_t max_prod_usable{static_cast<size_t>(std::numeric_limits<tOffset>::max())};
+    return (max_prod_usable / size < count || max_prod_usable / count < size);
+}
+
+BlockBlobClient GetBlockBlobClient(const std::string &bucket_name, const std::string &object_name)
+{
+    return GetContainerClient(bucket_name).GetBlockBlobClient(object_name);
+}
+
+struct ObjectInfo
+{
+    std::string name;
+    tOffset size;
+    std::string etag;
+};
+
+struct ObjectMetadata
+{
+    bool exists{false};
+    tOffset size{0};
+    std::string etag;
+    Azure::DateTime last_modified;
+};
+
+// Cache of the properties of objects, missing objects included, kept for a fixed time.
+// Entries are dropped as soon as this process modifies or removes the object.
+class MetadataCache
+{
+public:
+    void Configure(std::chrono::milliseconds ttl)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ttl_ = ttl;
+        entries_.clear();
+    }
+
+    bool Get(Service service, const std::string &bucket, const std::string &object, ObjectMetadata &metadata)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto found = entries_.find(MakeKey(service, bucket, object));
+        if (found == entries_.end())
+        {
+            return false;
+        }
+        if (found->second.expiry <= std::chrono::steady_clock::now())
+        {
+            entries_.erase(found);
+            return false;
+        }
+        metadata = found->second.metadata;
+        return true;
+    }
+
+    void Put(Service service, const std::string &bucket, const std::string &object, const ObjectMetadata &metadata)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (ttl_.count() <= 0)
+        {
+            return;
+        }
+
+        const auto now = std::chrono::steady_clock::now();
+        if (entries_.size() >= max_entries)
+        {
+            PurgeExpired(now);
+            if (entries_.size() >= max_entries)
+            {
+                entries_.clear();
+            }
+        }
+        entries_[MakeKey(service, bucket, object)] = Entry{metadata, now + ttl_};
+    }
+
+    // Drops the entry of an object, whatever service it was reached through
+    void Invalidate(const std::string &bucket, const std::string &object)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        entries_.erase(MakeKey(BLOB, bucket, object));
+        entries_.erase(MakeKey(SHARE, bucket, object));
+    }
+
+private:
+    static constexpr size_t max_entries{100000};
+
+    struct Entry
+    {
+        ObjectMetadata metadata;
+        std::chrono::steady_clock::time_point expiry;
+    };
+
+    // the URIs of the storage emulator have no service, they reach blobs
+    static std::string MakeKey(Service service, const std::string &bucket, const std::string &object)
+    {
+        std::string key{SHARE == service ? "share" : "blob"};
+        key.append(1, '\n').append(bucket).append(1, '\n').append(object);
+        return key;
+    }
+
+    void PurgeExpired(std::chrono::steady_clock::time_point now)
+    {
+        for (auto it = entries_.begin(); it != entries_.end();)
+        {
+            it = it->second.expiry <= now ? entries_.erase(it) : std::next(it);
+        }
+    }
+
+    std::mutex mutex_;
+    std::unordered_map<std::string, Entry> entries_;
+    std::chrono::milliseconds ttl_{0};
+};
+
+MetadataCache metadata_cache;
+
+// Free space of the file shares: quota minus usage, asked for again once the TTL has expired.
+// In between, the bytes written to a share through the driver are deducted from its last known free space.
+class ShareFreeSpace
+{
+public:
+    void Configure(std::chrono::milliseconds ttl)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ttl_ = ttl;
+        entries_.clear();
+    }
+
+    long long Get(const std::string &share_name, const ShareServiceClient &service_client)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto found = entries_.find(share_name);
+            if (found != entries_.end() && found->second.expiry > std::chrono::steady_clock::now())
+            {
+                return found->second.free_space;
+            }
+        }
+
+        // the quota is in GiB
+        const auto share_client = service_client.GetShareClient(share_name);
+        const long long quota = share_client.GetProperties().Value.Quota * 1024LL * 1024LL * 1024LL;
+        const long long usage = share_client.GetStatistics().Value.ShareUsageInBytes;
+        const long long free_space = std::max(0LL, quota - usage);
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        entries_[share_name] = Entry{free_space, std::chrono::steady_clock::now() + ttl_};
+        return free_space;
+    }
+
+    // Deducts the bytes written to a share, a negative count giving back the space of removed content
+    void Consume(const std::string &share_name, long long bytes)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto found = entries_.find(share_name);
+        if (found != entries_.end())
+        {
+            found->second.free_space = std::max(0LL, found->second.free_space - bytes);
+        }
+    }
+
+    // Forgets the free space of a share, asked for again on the next Get
+    void Invalidate(const std::string &share_name)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        entries_.erase(share_name);
+    }
+
+private:
+    struct Entry
+    {
+        long long free_space;
+        std::chrono::steady_clock::time_point expiry;
+    };
+
+    std::mutex mutex_;
+    std::unordered_map<std::string, Entry> entries_;
+    std::chrono::milliseconds ttl_{0};
+};
+
+ShareFreeSpace share_free_space;
+
+// Free space reported for blob containers, which have no quota
+long long blob_free_space{5LL * 1024LL * 1024LL * 1024LL * 1024LL};
+
+ObjectMetadata ToObjectMetadata(const Blobs::Models::BlobProperties &props)
+{
+    return ObjectMetadata{true, static_cast<tOffset>(props.BlobSize), props.ETag.ToString(), props.LastModified};
+}
+
+ObjectMetadata ToObjectMetadata(const Files::Shares::Models::FileProperties &props)
+{
+    return ObjectMetadata{true, static_cast<tOffset>(props.FileSize), props.ETag.ToString(), props.LastModified};
+}
+
+// Directories made by mkdir on blob containers. A blob container has no directories of its own, a directory
+// exists through the blobs below it: an empty directory made during the session exists until disconnection.
+std::mutex made_directories_mutex;
+std::unordered_set<std::string> made_directories;
+
+std::string MakeDirectoryKey(const std::string &bucket, const std::string &path)
+{
+    return bucket + '\n' + path;
+}
+
+// Tells whether a directory exists, from the metadata cache when possible, otherwise with a single request.
+// On blob containers, a directory exists if some blob name starts with its path: a hierarchical listing
+// of at most one entry tells. On file shares, directories have properties of their own.
+bool DirectoryExists(const ParseUriResult &names)
+{
+    std::string path = names.object;
+    if (!path.empty() && path.back() != '/')
+    {
+        path.push_back('/');
+    }
+
+    ObjectMetadata metadata;
+    if (metadata_cache.Get(names.service, names.bucket, path, metadata))
+    {
+        CountStat(stats.metadata_cache_hits);
+        return metadata.exists;
+    }
+    CountStat(stats.metadata_cache_misses);
+
+    if (SHARE != names.service)
+    {
+        std::lock_guard<std::mutex> lock(made_directories_mutex);
+        if (made_directories.count(MakeDirectoryKey(names.bucket, path)) > 0)
+        {
+            return true;
+        }
+    }
+
+    try
+    {
+        if (SHARE == names.service)
+        {
+            auto directory = GetShareServiceClient().GetShareClient(names.bucket).GetRootDirectoryClient();
+            if (!path.empty())
+            {
+                directory = directory.GetSubdirectoryClient(path.substr(0, path.size() - 1));
+            }
+            directory.GetProperties();
+            metadata.exists = true;
+        }
+        else
+        {
+            ListBlobsOptions options;
+            options.Prefix = path;
+            options.PageSizeHint = 1;
+            const auto page = GetContainerClient(names.bucket).ListBlobsByHierarchy("/", options);
+
+            // the root of an existing container always exists, a page may come back empty with more to come
+            metadata.exists = path.empty() || !page.Blobs.empty() || !page.BlobPrefixes.empty() || page.NextPageToken.HasValue();
+        }
+    }
+    catch (const Azure::Core::RequestFailedException &e)
+    {
+        if (e.StatusCode != Azure::Core::Http::HttpStatusCode::NotFound)
+        {
+            throw;
+        }
+        metadata.exists = false;
+    }
+
+    metadata_cache.Put(names.service, names.bucket, path, metadata);
+    return metadata.exists;
+}
+
+// Glob patterns in object names:
+//  - '*' matches any sequence of characters but '/'
+//  - "**/" matches zero or more complete directories, a "**" not followed by '/' matches anything
+//  - '?' matches any character but '/'
+//  - "[...]" matches a character of the class, "[!...]" or "[^...]" one that is not, ranges like a-z allowed
+//  - '\' escapes the next character
+
+// Returns the literal part of the pattern before its first wildcard, unescaped.
+// has_wildcards tells whether the pattern goes on after the prefix.
+std::string GetGlobLiteralPrefix(const std::string &pattern, bool &has_wildcards)
+{
+    std::string prefix;
+    has_wildcards = false;
+    for (size_t i = 0; i < pattern.size(); i++)
+    {
+        const char c = pattern[i];
+        if ('*' == c || '?' == c || '[' == c)
+        {
+            has_wildcards = true;
+            break;
+        }
+        if ('\\' == c && i + 1 < pattern.size())
+        {
+            i++;
+        }
+        prefix.push_back(pattern[i]);
+    }
+    return prefix;
+}
+
+bool IsGlobPattern(const std::string &object_name)
+{
+    bool has_wildcards;
+    GetGlobLiteralPrefix(object_name, has_wildcards);
+    return has_wildcards;
+}
+
+// The file service has no listing by pattern: a glob pattern would otherwise be sent as a file name,
+// and fail as if the file were missing
+void RejectSharePattern(const std::string &path)
+{
+    if (IsGlobPattern(path))
+    {
+        throw std::invalid_argument("Glob patterns are not supported on file shares: " + path);
+    }
+}
+
+// Name of the object written at a URI: escaped wildcards name a blob literally, as for the reads.
+// Throws if the name is a glob pattern, which names no single object to write.
+std::string GetWrittenObjectName(const ParseUriResult &names)
+{
+    bool has_wildcards;
+    const std::string literal_name = GetGlobLiteralPrefix(names.object, has_wildcards);
+    if (has_wildcards)
+    {
+        throw std::invalid_argument("Cannot write to a glob pattern: " + names.object);
+    }
+    return SHARE == names.service ? names.object : literal_name;
+}
+
+// Returns the properties of an object, from the metadata cache when possible.
+// A missing object is reported with exists set to false, other errors are thrown.
+// The entries are keyed by the name of the object itself, as the listings and the invalidations know it.
+ObjectMetadata GetObjectMetadata(const ParseUriResult &names)
+{
+    // escaped wildcards name a blob literally
+    bool has_wildcards;
+    const std::string object_name = SHARE == names.service ? names.object : GetGlobLiteralPrefix(names.object, has_wildcards);
+
+    ObjectMetadata metadata;
+    if (metadata_cache.Get(names.service, names.bucket, object_name, metadata))
+    {
+        CountStat(stats.metadata_cache_hits);
+        return metadata;
+    }
+    CountStat(stats.metadata_cache_misses);
+
+    try
+    {
+        if (SHARE == names.service)
+        {
+            RejectSharePattern(object_name);
+            metadata = ToObjectMetadata(GetShareFileClient(names.bucket, object_name).GetProperties().Value);
+        }
+        else
+        {
+            metadata = ToObjectMetadata(GetBlockBlobClient(names.bucket, object_name).GetProperties().Value);
+        }
+    }
+    catch (const Azure::Core::RequestFailedException &e)
+    {
+        if (e.StatusCode != Azure::Core::Http::HttpStatusCode::NotFound)
+        {
+            throw;
+        }
+        metadata = ObjectMetadata{};
+    }
+
+    metadata_cache.Put(names.service, names.bucket, object_name, metadata);
+    return metadata;
+}
+
+// Matches c against the class starting at pattern[start] == '['. Returns false if the class is not closed,
+// in which case the '[' is an ordinary character; otherwise end is set past the closing ']'.
+bool MatchGlobClass(const std::string &pattern, size_t start, char c, size_t &end, bool &matched)
+{
+    size_t i = start + 1;
+    const bool negated = i < pattern.size() && ('!' == pattern[i] || '^' == pattern[i]);
+    if (negated)
+    {
+        i++;
+    }
+
+    bool in_class{false};
+    // a ']' right after the opening bracket is part of the class
+    for (bool first = true; i < pattern.size() && (first || ']' != pattern[i]); first = false)
+    {
+        const char low = pattern[i];
+        char high = low;
+        if (i + 2 < pattern.size() && '-' == pattern[i + 1] && ']' != pattern[i + 2])
+        {
+            high = pattern[i + 2];
+            i += 2;
+        }
+        in_class = in_class || (low <= c && c <= high);
+        i++;
+    }
+
+    if (i >= pattern.size())
+    {
+        return false;
+    }
+    end = i + 1;
+    matched = '/' != c && in_class != negated;
+    return true;
+}
+
+bool GlobMatchFrom(const std::string &pattern, size_t p, const std::string &name, size_t n)
+{
+    while (p < pattern.size())
+    {
+        const char c = pattern[p];
+        if ('*' == c)
+        {
+            if (p + 1 < pattern.size() && '*' == pattern[p + 1])
+            {
+                if (p + 2 < pattern.size() && '/' == pattern[p + 2])
+                {
+                    // no directory, or any sequence ending with a separator
+                    if (GlobMatchFrom(pattern, p + 3, name, n))
+                    {
+                        return true;
+                    }
+                    for (size_t i = n; i < name.size(); i++)
+                    {
+                        if ('/' == name[i] && GlobMatchFrom(pattern, p + 3, name, i + 1))
+                        {
+                            return true;
+                        }
+                    }
+                    return false;
+                }
+                for (size_t i = n; i <= name.size(); i++)
+                {
+                    if (GlobMatchFrom(pattern, p + 2, name, i))
+                    {
+                        return true;
+                    }
+                }
+                return false;
+            }
+
+            for (size_t i = n;; i++)
+            {
+                if (GlobMatchFrom(pattern, p + 1, name, i))
+                {
+                    return true;
+                }
+                if (i == name.size() || '/' == name[i])
+                {
+                    return false;
+                }
+            }
+        }
+
+        if (n == name.size())
+        {
+            return false;
+        }
+
+        if ('?' == c)
+        {
+            if ('/' == name[n])
+            {
+                return false;
+            }
+            p++;
+            n++;
+            continue;
+        }
+
+        if ('[' == c)
+        {
+            size_t end;
+            bool matched;
+            if (MatchGlobClass(pattern, p, name[n], end, matched))
+            {
+                if (!matched)
+                {
+                    return false;
+                }
+                p = end;
+                n++;
+                continue;
+            }
+        }
+
+        if ('\\' == c && p + 1 < pattern.size())
+        {
+            p++;
+        }
+        if (pattern[p] != name[n])
+        {
+            return false;
+        }
+        p++;
+        n++;
+    }
+    return n == name.size();
+}
+
+bool GlobMatch(const std::string &pattern, const std::string &name)
+{
+    return GlobMatchFrom(pattern, 0, name, 0);
+}
+
+Azure::Core::RequestFailedException MakeRequestFailedException(Azure::Core::Http::HttpStatusCode status_code, const std::string &message)
+{
+    Azure::Core::RequestFailedException e(message);
+    e.StatusCode = status_code;
+    e.ReasonPhrase = message;
+    return e;
+}
+
+Azure::Core::RequestFailedException MakeNotFoundException(const std::string &message)
+{
+    return MakeRequestFailedException(Azure::Core::Http::HttpStatusCode::NotFound, message);
+}
+
+// Resolves the object name, possibly a glob pattern, into the list of matching objects with their sizes,
+// in lexicographic order.
+// Patterns are resolved in a single paged listing of the blobs starting with the literal prefix of the
+// pattern, matched against the pattern as the pages come in.
+// Throws Azure::Core::RequestFailedException if no object matches.
+std::vector<ObjectInfo> ListObjects(const std::string &bucket_name, const std::string &object_name)
+{
+    bool has_wildcards;
+    const std::string prefix = GetGlobLiteralPrefix(object_name, has_wildcards);
+
+    if (!has_wildcards)
+    {
+        // always fresh: the readers rely on the ETag to detect modifications while they read
+        auto props = GetBlockBlobClient(bucket_name, prefix).GetProperties();
+        metadata_cache.Put(BLOB, bucket_name, prefix, ToObjectMetadata(props.Value));
+        return {ObjectInfo{prefix, static_cast<tOffset>(props.Value.BlobSize), props.Value.ETag.ToString()}};
+    }
+
+    ListBlobsOptions options;
+    options.Prefix = prefix;
+
+    std::vector<ObjectInfo> objects;
+    for (auto page = GetContainerClient(bucket_name).ListBlobs(options); page.HasPage(); page.MoveToNextPage())
+    {
+        for (const auto &blob : page.Blobs)
+        {
+            if (GlobMatch(object_name, blob.Name))
+            {
+                objects.push_back(ObjectInfo{blob.Name, static_cast<tOffset>(blob.BlobSize), blob.Details.ETag.ToString()});
+            }
+        }
+    }
+
+    if (objects.empty())
+    {
+        throw MakeNotFoundException("No object matches " + object_name);
+    }
+    return objects;
+}
+
+// Resolved layout of a multi-part file: its parts, their sizes without the repeated headers and their ETags.
+// The parts are shared by all the readers of the file.
+struct Manifest
+{
+    std::shared_ptr<const PartManifest> parts;
+    tOffset header_length{0};
+    tOffset total_size{0};
+};
+
+// Manifests of the glob patterns opened so far, so that opening the same multi-part file again needs
+// neither a listing nor header probes.
+// A manifest is used as is for the TTL of the metadata cache. Past that, a new listing is needed, but the
+// manifest is still reused if the listing gives the same parts with the same ETags. Writes and removals
+// through the driver drop the manifests of the patterns matching the object.
+class ManifestCache
+{
+public:
+    void Configure(std::chrono::milliseconds ttl)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ttl_ = ttl;
+        entries_.clear();
+    }
+
+    // Returns the manifest of the pattern if it has not expired
+    bool Get(const std::string &bucket, const std::string &pattern, Manifest &manifest)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto found = entries_.find(MakeKey(bucket, pattern));
+        if (found == entries_.end() || found->second.expiry <= std::chrono::steady_clock::now())
+        {
+            return false;
+        }
+        manifest = found->second.manifest;
+        return true;
+    }
+
+    // Returns the manifest of the pattern, expired or not, if the parts it was built from are those of
+    // the listing. The manifest is then fresh again.
+    bool GetIfUnchanged(const std::string &bucket, const std::string &pattern, const std::vector<ObjectInfo> &listing, Manifest &manifest)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto found = entries_.find(MakeKey(bucket, pattern));
+        if (found == entries_.end() || !IsListingOf(found->second.manifest, listing))
+        {
+            return false;
+        }
+        found->second.expiry = std::chrono::steady_clock::now() + ttl_;
+        manifest = found->second.manifest;
+        return true;
+    }
+
+    void Put(const std::string &bucket, const std::string &pattern, const Manifest &manifest)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (ttl_.count() <= 0)
+        {
+            return;
+        }
+        if (entries_.size() >= max_entries)
+        {
+            entries_.clear();
+        }
+        entries_[MakeKey(bucket, pattern)] = Entry{bucket, pattern, manifest, std::chrono::steady_clock::now() + ttl_};
+    }
+
+    // Drops the manifests of the patterns the object matches
+    void Invalidate(const std::string &bucket, const std::string &object)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto it = entries_.begin(); it != entries_.end();)
+        {
+            const bool matches = it->second.bucket == bucket && GlobMatch(it->second.pattern, object);
+            it = matches ? entries_.erase(it) : std::next(it);
+        }
+    }
+
+private:
+    static constexpr size_t max_entries{1024};
+
+    struct Entry
+    {
+        std::string bucket;
+        std::string pattern;
+        Manifest manifest;
+        std::chrono::steady_clock::time_point expiry;
+    };
+
+    static std::string MakeKey(const std::string &bucket, const std::string &pattern)
+    {
+        std::string key{bucket};
+        key.append(1, '\n').append(pattern);
+        return key;
+    }
+
+    static bool IsListingOf(const Manifest &manifest, const std::vector<ObjectInfo> &listing)
+    {
+        if (manifest.parts->Count() != listing.size())
+        {
+            return false;
+        }
+        size_t i = 0;
+        bool same = true;
+        manifest.parts->ForEachPart([&](const std::string &name, const std::string &etag, long long)
+                                    {
+                                        same = same && name == listing[i].name && etag == listing[i].etag;
+                                        i++; });
+        return same;
+    }
+
+    std::mutex mutex_;
+    std::unordered_map<std::string, Entry> entries_;
+    std::chrono::milliseconds ttl_{0};
+};
+
+ManifestCache manifest_cache;
+
+// Downloads the bytes of the range [start_range, end_range[ of an object straight into buffer.
+// Returns the number of bytes received, less than requested only if the object is shorter.
+// If etag is not empty, the download fails if the object was modified since the etag was read.
+long long int DownloadFileRangeToBuffer(const BlockBlobClient &client,
+                                        const std::string &etag,
+                                        char *buffer,
+                                        tOffset start_range,
+                                        tOffset end_range)
+{
+    if (end_range <= start_range)
+    {
+        return 0;
+    }
+
+    DownloadBlobToOptions options;
+    Azure::Core::Http::HttpRange range;
+    range.Offset = start_range;
+    range.Length = end_range - start_range;
+    options.Range = range;
+    if (!etag.empty())
+    {
+        options.AccessConditions.IfMatch = Azure::ETag(etag);
+    }
+
+    auto response = client.DownloadTo(reinterpret_cast<uint8_t *>(buffer), static_cast<size_t>(end_range - start_range), options);
+
+    long long int num_read = response.Value.ContentRange.Length.HasValue()
+                                 ? static_cast<long long>(response.Value.ContentRange.Length.Value())
+                                 : end_range - start_range;
+    spdlog::debug("read = {}", num_read);
+
+    return num_read;
+}
+
+long long int DownloadFileRangeToBuffer(const std::string &bucket_name,
+                                        const std::string &object_name,
+                                        const std::string &etag,
+                                        char *buffer,
+                                        tOffset start_range,
+                                        tOffset end_range)
+{
+    return DownloadFileRangeToBuffer(GetBlockBlobClient(bucket_name, object_name), etag, buffer, start_range, end_range);
+}
+
+// Same as DownloadFileRangeToBuffer for a file of a share.
+// The file service has no conditional reads: the ETag of the response is checked instead.
+long long int DownloadShareFileRangeToBuffer(const ShareFileClient &client,
+                                             const std::string &etag,
+                                             char *buffer,
+                                             tOffset start_range,
+                                             tOffset end_range)
+{
+    if (end_range <= start_range)
+    {
+        return 0;
+    }
+
+    DownloadFileToOptions options;
+    Azure::Core::Http::HttpRange range;
+    range.Offset = start_range;
+    range.Length = end_range - start_range;
+    options.Range = range;
+
+    auto response = client.DownloadTo(reinterpret_cast<uint8_t *>(buffer), static_cast<size_t>(end_range - start_range), options);
+    if (!etag.empty() && response.Value.Details.ETag.ToString() != etag)
+    {
+        throw MakeRequestFailedException(Azure::Core::Http::HttpStatusCode::PreconditionFailed, "The file was modified since it was opened: " + client.GetUrl());
+    }
+
+    return response.Value.ContentRange.Length.HasValue()
+               ? static_cast<long long>(response.Value.ContentRange.Length.Value())
+               : end_range - start_range;
+}
+
+long long int DownloadRangeToBuffer(Service service,
+                                    const std::string &bucket_name,
+                                    const std::string &object_name,
+                                    const std::string &etag,
+                                    char *buffer,
+                                    tOffset start_range,
+                                    tOffset end_range)
+{
+    if (SHARE == service)
+    {
+        return DownloadShareFileRangeToBuffer(GetShareFileClient(bucket_name, object_name), etag, buffer, start_range, end_range);
+    }
+    return DownloadFileRangeToBuffer(bucket_name, object_name, etag, buffer, start_range, end_range);
+}
+
+namespace azureplugin
+{
+    // Clients of the parts of a reader, resolved once when the reader is opened so that its reads do not go
+    // through the process-wide map of container clients
+    struct PartClients
+    {
+        std::vector<BlockBlobClient> blobs;
+        std::vector<ShareFileClient> files;
+    };
+}
+
+std::shared_ptr<const PartClients> MakePartClients(const std::string &bucket_name, const PartManifest &parts, Service service)
+{
+    auto clients = std::make_shared<PartClients>();
+    if (SHARE == service)
+    {
+        auto root = GetShareServiceClient().GetShareClient(bucket_name).GetRootDirectoryClient();
+        clients->files.reserve(parts.Count());
+        for (size_t i = 0; i < parts.Count(); i++)
+        {
+            clients->files.push_back(root.GetFileClient(parts.Name(i)));
+        }
+    }
+    else
+    {
+        const BlobContainerClient container = GetContainerClient(bucket_name);
+        clients->blobs.reserve(parts.Count());
+        for (size_t i = 0; i < parts.Count(); i++)
+        {
+            clients->blobs.push_back(container.GetBlockBlobClient(parts.Name(i)));
+        }
+    }
+    return clients;
+}
+
+// Downloads the range [start_range, end_range[ of one part of a reader, with the client resolved at opening
+long long int DownloadPartRange(const MultiPartFile &multifile, size_t part, char *buffer, tOffset start_range, tOffset end_range)
+{
+    const PartManifest &parts = *multifile.parts_;
+    if (!multifile.clients_)
+    {
+        return DownloadRangeToBuffer(multifile.service_, multifile.bucketname_, parts.Name(part), parts.ETag(part), buffer, start_range, end_range);
+    }
+    if (SHARE == multifile.service_)
+    {
+        return DownloadShareFileRangeToBuffer(multifile.clients_->files[part], parts.ETag(part), buffer, start_range, end_range);
+    }
+    return DownloadFileRangeToBuffer(multifile.clients_->blobs[part], parts.ETag(part), buffer, start_range, end_range);
+}
+
+// Process-wide LRU cache of fixed-size blocks of objects, shared by all the reader handles.
+// A block is identified by its object and the object ETag, so that a modified object never hits stale blocks.
+// The blocks are spread by key over kShardCount independently locked LRU lists, each holding its share of the
+// capacity, so that concurrent readers rarely wait for one another.
+class BlockCache
+{
+public:
+    using Block = std::shared_ptr<const std::vector<char>>;
+
+    void Configure(size_t capacity)
+    {
+        capacity_ = capacity;
+        for (auto &shard : shards_)
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            shard.capacity = capacity / kShardCount;
+            shard.Clear();
+        }
+    }
+
+    bool IsEnabled() const { return capacity_ > 0; }
+    size_t GetCapacity() const { return capacity_; }
+
+    Block Get(const std::string &bucket, const std::string &object, const std::string &etag, tOffset index)
+    {
+        const std::string key = MakeKey(bucket, object, etag, index);
+        Shard &shard = ShardOf(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto found = shard.index.find(key);
+        if (found == shard.index.end())
+        {
+            return nullptr;
+        }
+        shard.entries.splice(shard.entries.begin(), shard.entries, found->second);
+        return found->second->block;
+    }
+
+    void Put(const std::string &bucket, const std::string &object, const std::string &etag, tOffset index, Block block)
+    {
+        std::string key = MakeKey(bucket, object, etag, index);
+        Shard &shard = ShardOf(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        if (shard.index.count(key) > 0 || block->size() > shard.capacity)
+        {
+            return;
+        }
+
+        shard.size += block->size();
+        shard.entries.push_front(Entry{key, bucket, object, std::move(block)});
+        shard.index.emplace(std::move(key), shard.entries.begin());
+
+        while (shard.size > shard.capacity)
+        {
+            shard.Erase(std::prev(shard.entries.end()));
+        }
+    }
+
+    // Drops all the blocks of an object, whatever their ETag
+    void Invalidate(const std::string &bucket, const std::string &object)
+    {
+        for (auto &shard : shards_)
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            for (auto it = shard.entries.begin(); it != shard.entries.end();)
+            {
+                auto current = it++;
+                if (current->bucket == bucket && current->object == object)
+                {
+                    shard.Erase(current);
+                }
+            }
+        }
+    }
+
+private:
+    static constexpr size_t kShardCount = 16;
+
+    struct Entry
+    {
+        std::string key;
+        std::string bucket;
+        std::string object;
+        Block block;
+    };
+    using EntryIt = std::list<Entry>::iterator;
+
+    struct Shard
+    {
+        std::mutex mutex;
+        std::list<Entry> entries; // most recently used first
+        std::unordered_map<std::string, EntryIt> index;
+        size_t size{0};
+        size_t capacity{0};
+
+        void Erase(EntryIt it)
+        {
+            size -= it->block->size();
+            index.erase(it->key);
+            entries.erase(it);
+        }
+
+        void Clear()
+        {
+            entries.clear();
+            index.clear();
+            size = 0;
+        }
+    };
+
+    static std::string MakeKey(const std::string &bucket, const std::string &object, const std::string &etag, tOffset index)
+    {
+        std::string key;
+        key.reserve(bucket.size() + object.size() + etag.size() + 24);
+        key.append(bucket).append(1, '\n').append(object).append(1, '\n').append(etag).append(1, '\n').append(std::to_string(index));
+        return key;
+    }
+
+    Shard &ShardOf(const std::string &key)
+    {
+        return shards_[std::hash<std::string>{}(key) % kShardCount];
+    }
+
+    std::array<Shard, kShardCount> shards_;
+    size_t capacity_{0};
+};
+
+// Size of the blocks of both the memory and the disk caches
+tOffset cache_block_size{preferred_buffer_size};
+
+// Reads smaller than a block by more than this ratio bypass the caches on a miss
+constexpr tOffset small_read_ratio{16};
+
+BlockCache block_cache;
+
+// Files of a cache directory, with their size and modification time
+struct CachedFileInfo
+{
+    std::string name;
+    tOffset size{0};
+    long long modified{0};
+};
+
+std::vector<CachedFileInfo> ListCacheDirectory(const std::string &directory)
+{
+    std::vector<CachedFileInfo> files;
+#ifdef __unix_or_mac__
+    DIR *dir = opendir(directory.c_str());
+    if (!dir)
+    {
+        return files;
+    }
+    for (struct dirent *item = readdir(dir); item; item = readdir(dir))
+    {
+        struct stat file_stat;
+        const std::string name = item->d_name;
+        if (stat((directory + '/' + name).c_str(), &file_stat) == 0 && S_ISREG(file_stat.st_mode))
+        {
+            files.push_back(CachedFileInfo{name, static_cast<tOffset>(file_stat.st_size), static_cast<long long>(file_stat.st_mtime)});
+        }
+    }
+    closedir(dir);
+#else
+    WIN32_FIND_DATAA item;
+    HANDLE find = FindFirstFileA((directory + "\\*").c_str(), &item);
+    if (find == INVALID_HANDLE_VALUE)
+    {
+        return files;
+    }
+    do
+    {
+        if (!(item.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+        {
+            const tOffset size = (static_cast<tOffset>(item.nFileSizeHigh) << 32) | item.nFileSizeLow;
+            const long long modified = (static_cast<long long>(item.ftLastWriteTime.dwHighDateTime) << 32) | item.ftLastWriteTime.dwLowDateTime;
+            files.push_back(CachedFileInfo{item.cFileName, size, modified});
+        }
+    } while (FindNextFileA(find, &item));
+    FindClose(find);
+#endif
+    return files;
+}
+
+// Optional persistent cache of blocks in a local directory, shared by the processes using it.
+// Each block is a file of its own, named after the object, the ETag, the block size and the block index, so
+// that the blocks of different versions of an object never mix. A block is written to a temporary file and
+// renamed once complete: a block file is immutable and always whole, which lets the processes share the
+// directory without locking it. The disk I/O runs outside of the lock of the cache, which only guards its
+// configuration and index; concurrent writes of the same block in the process are skipped.
+// The cache keeps at most its budget of bytes, evicting the least recently used blocks. The blocks written by
+// other processes count once seen, at configuration or when read.
+class DiskCache
+{
+public:
+    void Configure(const std::string &directory, tOffset block_size, tOffset budget)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        entries_.clear();
+        index_.clear();
+        writing_.clear();
+        size_ = 0;
+        directory_.clear();
+        block_size_ = block_size;
+        budget_ = budget;
+        if (directory.empty() || block_size <= 0 || budget <= 0)
+        {
+            return;
+        }
+
+        const std::string probe = directory + "/.khiops-azure-probe";
+        std::ofstream probe_stream(probe);
+        if (!probe_stream)
+        {
+            spdlog::warn("Cannot write to disk cache directory {}, disk cache disabled", directory);
+            return;
+        }
+        probe_stream.close();
+        std::remove(probe.c_str());
+        directory_ = directory;
+
+        // the blocks already there, oldest first so that they are evicted first
+        auto files = ListCacheDirectory(directory_);
+        std::sort(files.begin(), files.end(), [](const CachedFileInfo &a, const CachedFileInfo &b)
+                  { return a.modified < b.modified; });
+        for (const auto &file : files)
+        {
+            if (IsBlockName(file.name))
+            {
+                Insert(file.name, file.size);
+            }
+        }
+        RemoveFiles(directory_, Evict());
+    }
+
+    bool IsEnabled()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return !directory_.empty();
+    }
+
+    BlockCache::Block Get(const std::string &bucket, const std::string &object, const std::string &etag, tOffset index)
+    {
+        const Settings settings = GetSettings();
+        if (settings.directory.empty())
+        {
+            return nullptr;
+        }
+        const tOffset block_size = settings.block_size;
+        const std::string name = MakeBlockName(bucket, object, etag, index, block_size);
+        std::ifstream data(settings.directory + '/' + name, std::ios::binary | std::ios::ate);
+        if (!data)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            Erase(name);
+            return nullptr;
+        }
+
+        const tOffset size = static_cast<tOffset>(data.tellg());
+        auto block = std::make_shared<std::vector<char>>(static_cast<size_t>(std::max<tOffset>(0, std::min(size, block_size))));
+        data.seekg(0);
+        if (size > block_size || !data.read(block->data(), static_cast<std::streamsize>(block->size())))
+        {
+            spdlog::debug("Disk cache: cannot read block {} of {}", index, object);
+            return nullptr;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto found = index_.find(name);
+        if (found != index_.end())
+        {
+            entries_.splice(entries_.begin(), entries_, found->second);
+        }
+        else
+        {
+            Insert(name, size);
+        }
+        return block;
+    }
+
+    void Put(const std::string &bucket, const std::string &object, const std::string &etag, tOffset index, const BlockCache::Block &block)
+    {
+        const Settings settings = GetSettings();
+        if (settings.directory.empty())
+        {
+            return;
+        }
+        const std::string name = MakeBlockName(bucket, object, etag, index, settings.block_size);
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (index_.count(name) > 0 || !writing_.insert(name).second)
+            {
+                return;
+            }
+        }
+
+        // published by renaming a complete temporary file, readers never see a partial block
+        const std::string path = settings.directory + '/' + name;
+        const std::string temp_path = settings.directory + "/." + name + '.' + MakeTempSuffix() + ".tmp";
+        bool written{false};
+        {
+            std::ofstream data(temp_path, std::ios::binary | std::ios::trunc);
+            written = data.write(block->data(), static_cast<std::streamsize>(block->size())) && data.flush();
+        }
+        if (written && std::rename(temp_path.c_str(), path.c_str()) != 0)
+        {
+            // e.g. on Windows when another process already published the block
+            std::ifstream published(path, std::ios::binary);
+            written = static_cast<bool>(published);
+        }
+        std::remove(temp_path.c_str());
+        if (!written)
+        {
+            spdlog::debug("Disk cache: cannot write block {} of {}", index, object);
+        }
+
+        std::vector<std::string> evicted;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            writing_.erase(name);
+            if (written && index_.count(name) == 0)
+            {
+                Insert(name, static_cast<tOffset>(block->size()));
+                evicted = Evict();
+            }
+        }
+        RemoveFiles(settings.directory, evicted);
+    }
+
+    // Drops the known blocks of an object, whatever their ETag
+    void Invalidate(const std::string &bucket, const std::string &object)
+    {
+        std::vector<std::string> removed;
+        std::string directory;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (directory_.empty())
+            {
+                return;
+            }
+            directory = directory_;
+            const std::string prefix = HashString({bucket, object}) + '-';
+            for (auto it = entries_.begin(); it != entries_.end();)
+            {
+                auto current = it++;
+                if (current->name.compare(0, prefix.size(), prefix) == 0)
+                {
+                    removed.push_back(current->name);
+                    size_ -= current->size;
+                    index_.erase(current->name);
+                    entries_.erase(current);
+                }
+            }
+        }
+        RemoveFiles(directory, removed);
+    }
+
+private:
+    // The configuration, read once by each operation: Configure may change it meanwhile
+    struct Settings
+    {
+        std::string directory;
+        tOffset block_size;
+    };
+
+    Settings GetSettings()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return Settings{directory_, block_size_};
+    }
+
+    struct Entry
+    {
+        std::string name;
+        tOffset size;
+    };
+    using EntryIt = std::list<Entry>::iterator;
+
+    // FNV-1a, stable across processes and platforms
+    static std::string HashString(std::initializer_list<std::string> values)
+    {
+        uint64_t hash = 14695981039346656037ULL;
+        for (const auto &value : values)
+        {
+            for (const char c : value)
+            {
+                hash ^= static_cast<unsigned char>(c);
+                hash *= 1099511628211ULL;
+            }
+            hash ^= '\n';
+            hash *= 1099511628211ULL;
+        }
+
+        std::ostringstream os;
+        os << std::hex << std::setw(16) << std::setfill('0') << hash;
+        return os.str();
+    }
+
+    // <object hash>-<ETag hash>-<block size>-<index>.block
+    static std::string MakeBlockName(const std::string &bucket, const std::string &object, const std::string &etag, tOffset index, tOffset block_size)
+    {
+        std::ostringstream os;
+        os << HashString({bucket, object}) << '-' << HashString({etag}) << '-' << block_size << '-' << index << ".block";
+        return os.str();
+    }
+
+    static bool IsBlockName(const std::string &name)
+    {
+        const std::string suffix = ".block";
+        return name.size() > suffix.size() && name[0] != '.' && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0;
+    }
+
+    static std::string MakeTempSuffix()
+    {
+        thread_local std::mt19937_64 generator{std::random_device{}()};
+        std::ostringstream os;
+        os << std::hex << generator();
+        return os.str();
+    }
+
+    // pre condition: mutex_ is held
+    void Insert(const std::string &name, tOffset size)
+    {
+        entries_.push_front(Entry{name, size});
+        index_.emplace(name, entries_.begin());
+        size_ += size;
+    }
+
+    // pre condition: mutex_ is held
+    void Erase(const std::string &name)
+    {
+        auto found = index_.find(name);
+        if (found != index_.end())
+        {
+            size_ -= found->second->size;
+            entries_.erase(found->second);
+            index_.erase(found);
+        }
+    }
+
+    // Drops the least recently used blocks over the budget, returns the names of their files to remove.
+    // pre condition: mutex_ is held
+    std::vector<std::string> Evict()
+    {
+        std::vector<std::string> evicted;
+        while (size_ > budget_ && !entries_.empty())
+        {
+            const Entry &oldest = entries_.back();
+            evicted.push_back(oldest.name);
+            size_ -= oldest.size;
+            index_.erase(oldest.name);
+            entries_.pop_back();
+        }
+        return evicted;
+    }
+
+    static void RemoveFiles(const std::string &directory, const std::vector<std::string> &names)
+    {
+        for (const auto &name : names)
+        {
+            std::remove((directory + '/' + name).c_str());
+        }
+    }
+
+    std::mutex mutex_; // guards the configuration and the index, never held during disk I/O
+    std::string directory_;
+    tOffset block_size_{0};
+    tOffset budget_{0};
+    tOffset size_{0};
+    std::list<Entry> entries_; // most recently used first
+    std::unordered_map<std::string, EntryIt> index_;
+    std::unordered_set<std::string> writing_;
+};
+
+DiskCache disk_cache;
+
+// Drops whatever this process knows about an object it modified or removed
+void InvalidateCachedObject(const std::string &bucket_name, const std::string &object_name)
+{
+    metadata_cache.Invalidate(bucket_name, object_name);
+    // the directories holding the object may have appeared or vanished with it
+    for (size_t slash = object_name.find('/'); slash != std::string::npos; slash = object_name.find('/', slash + 1))
+    {
+        metadata_cache.Invalidate(bucket_name, object_name.substr(0, slash + 1));
+    }
+    manifest_cache.Invalidate(bucket_name, object_name);
+    block_cache.Invalidate(bucket_name, object_name);
+    disk_cache.Invalidate(bucket_name, object_name);
+}
+
+// Reads the range [start, end[ of one part of a reader, going through the block cache when possible.
+// Returns the number of bytes read, less than requested only if the object is shorter.
+long long ReadPartRange(const MultiPartFile &multifile, size_t part, char *buffer, tOffset start, tOffset end)
+{
+    // ranges larger than half the memory cache would only evict what the other readers need
+    const bool use_memory = block_cache.IsEnabled() && end - start <= static_cast<tOffset>(block_cache.GetCapacity() / 2);
+    const bool use_disk = disk_cache.IsEnabled();
+    if (!use_memory && !use_disk)
+    {
+        return DownloadPartRange(multifile, part, buffer, start, end);
+    }
+    const std::string etag = multifile.parts_->ETag(part);
+    if (etag.empty())
+    {
+        return DownloadPartRange(multifile, part, buffer, start, end);
+    }
+    if (end <= start)
+    {
+        return 0;
+    }
+
+    const std::string &bucket_name = multifile.bucketname_;
+    const std::string object_name = multifile.parts_->Name(part);
+
+    const tOffset block_size = cache_block_size;
+    const tOffset first_block = start / block_size;
+    const tOffset last_block = (end - 1) / block_size;
+
+    std::vector<BlockCache::Block> blocks;
+    blocks.reserve(static_cast<size_t>(last_block - first_block + 1));
+    for (tOffset index = first_block; index <= last_block; index++)
+    {
+        BlockCache::Block block = use_memory ? block_cache.Get(bucket_name, object_name, etag, index) : nullptr;
+        if (block)
+        {
+            CountStat(stats.block_cache_hits);
+        }
+        else if (use_disk)
+        {
+            block = disk_cache.Get(bucket_name, object_name, etag, index);
+            if (block)
+            {
+                CountStat(stats.disk_cache_hits);
+                if (use_memory)
+                {
+                    block_cache.Put(bucket_name, object_name, etag, index, block);
+                }
+            }
+        }
+        if (!block)
+        {
+            CountStat(stats.block_cache_misses);
+        }
+        blocks.push_back(std::move(block));
+    }
+
+    const bool all_cached = std::all_of(blocks.begin(), blocks.end(), [](const BlockCache::Block &block)
+                                        { return block != nullptr; });
+    if (!all_cached && (end - start) * small_read_ratio < block_size)
+    {
+        // a read much smaller than a block would download and keep many times what it asked for
+        return DownloadPartRange(multifile, part, buffer, start, end);
+    }
+
+    // download each run of consecutive missing blocks in a single request
+    std::vector<bool> in_place(blocks.size(), false);
+    for (size_t i = 0; i < blocks.size();)
+    {
+        if (blocks[i])
+        {
+            i++;
+            continue;
+        }
+        size_t run_end = i + 1;
+        while (run_end < blocks.size() && !blocks[run_end])
+        {
+            run_end++;
+        }
+
+        const tOffset run_start_offset = (first_block + static_cast<tOffset>(i)) * block_size;
+        const tOffset run_end_offset = (first_block + static_cast<tOffset>(run_end)) * block_size;
+        auto block_length = [&](size_t j, tOffset run_read)
+        {
+            return std::max<tOffset>(0, std::min(block_size, run_read - static_cast<tOffset>(j - i) * block_size));
+        };
+
+        if (start <= run_start_offset && run_end_offset <= end)
+        {
+            // whole blocks of the range: downloaded in place, the caches get a copy
+            char *run = buffer + (run_start_offset - start);
+            const tOffset run_read = DownloadPartRange(multifile, part, run, run_start_offset, run_end_offset);
+            for (size_t j = i; j < run_end; j++)
+            {
+                const char *block_data = run + static_cast<tOffset>(j - i) * block_size;
+                blocks[j] = std::make_shared<std::vector<char>>(block_data, block_data + block_length(j, run_read));
+                in_place[j] = true;
+            }
+        }
+        else if (run_end == i + 1)
+        {
+            // a single block partly outside the range: downloaded into the block itself
+            auto block = std::make_shared<std::vector<char>>(static_cast<size_t>(block_size));
+            const tOffset run_read = DownloadPartRange(multifile, part, block->data(), run_start_offset, run_end_offset);
+            block->resize(static_cast<size_t>(block_length(i, run_read)));
+            blocks[i] = std::move(block);
+        }
+        else
+        {
+            std::vector<char> run(static_cast<size_t>(run_end_offset - run_start_offset));
+            const tOffset run_read = DownloadPartRange(multifile, part, run.data(), run_start_offset, run_end_offset);
+            for (size_t j = i; j < run_end; j++)
+            {
+                const auto block_data = run.begin() + static_cast<tOffset>(j - i) * block_size;
+                blocks[j] = std::make_shared<std::vector<char>>(block_data, block_data + block_length(j, run_read));
+            }
+        }
+
+        for (size_t j = i; j < run_end; j++)
+        {
+            if (use_memory)
+            {
+                block_cache.Put(bucket_name, object_name, etag, first_block + static_cast<tOffset>(j), blocks[j]);
+            }
+            if (use_disk)
+            {
+                disk_cache.Put(bucket_name, object_name, etag, first_block + static_cast<tOffset>(j), blocks[j]);
+            }
+        }
+        i = run_end;
+    }
+
+    tOffset num_read{0};
+    for (size_t i = 0; i < blocks.size(); i++)
+    {
+        const tOffset block_offset = (first_block + static_cast<tOffset>(i)) * block_size;
+        const tOffset from = std::max(start, block_offset) - block_offset;
+        const tOffset to = std::min(end - block_offset, static_cast<tOffset>(blocks[i]->size()));
+        if (to <= from)
+        {
+            break;
+        }
+        if (!in_place[i])
+        {
+            std::memcpy(buffer + num_read, blocks[i]->data() + from, static_cast<size_t>(to - from));
+        }
+        num_read += to - from;
+        if (static_cast<tOffset>(blocks[i]->size()) < block_size)
+        {
+            // end of object
+            break;
+        }
+    }
+    return num_read;
+}
+
+// Reads to_read bytes of the logical content of multifile starting at offset.
+// The logical content is the concatenation of the parts, the common header being kept only for the first one.
+// Does not modify multifile, so that background readers can share it.
+long long ReadBytesAt(const MultiPartFile &multifile, tOffset offset, char *buffer, tOffset to_read)
+{
+    // Start at first usable file chunk
+    // Advance through file chunks, advancing buffer pointer
+    // Until last requested byte was read
+    // Or error occured
+
+    tOffset bytes_read{0};
+
+    // Lookup item containing initial bytes at requested offset
+    const PartManifest &parts = *multifile.parts_;
+    const tOffset common_header_length = multifile.commonHeaderLength_;
+    char *buffer_pos = buffer;
+
+    tOffset part_start{0};
+    size_t idx = parts.FindPart(offset, part_start);
+
+    if (idx >= parts.Count())
+    {
+        return 0;
+    }
+
+    spdlog::debug("Use item {} to read @ {} (start = {})", idx, offset, part_start);
+
+    auto read_range_and_update = [&](size_t part, tOffset start, tOffset end)
+    {
+        tOffset actual_read = ReadPartRange(multifile, part, buffer_pos, start, end);
+
+        bytes_read += actual_read;
+        buffer_pos += actual_read;
+        offset += actual_read;
+
+        if (actual_read < (end - start))
+        {
+            spdlog::debug("End of file encountered");
+            to_read = 0;
+        }
+        else
+        {
+            to_read -= actual_read;
+        }
+    };
+
+    // first file read
+
+    const tOffset file_start = (idx == 0) ? offset : offset - part_start + common_header_length;
+    const tOffset read_end = std::min(file_start + to_read, file_start + part_start + parts.PartSize(idx) - offset);
+
+    read_range_and_update(idx, file_start, read_end);
+
+    // continue with the next files
+    while (to_read && idx + 1 < parts.Count())
+    {
+        // read the missing bytes in the next files as necessary
+        idx++;
+        const tOffset start = common_header_length;
+        const tOffset end = std::min(start + to_read, start + parts.PartSize(idx));
+
+        read_range_and_update(idx, start, end);
+    }
+
+    return bytes_read;
+}
+
+// Bounded pool of worker threads running the background tasks. The workers are started on demand, up to
+// thread_count, and driver_disconnect stops them once all the queued tasks have completed, so that no task
+// outlives the connection.
+class BackgroundPool
+{
+public:
+    // a host may unload the driver without disconnecting
+    ~BackgroundPool()
+    {
+        Stop();
+    }
+
+    void Configure(size_t thread_count)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        thread_count_ = std::max<size_t>(1, thread_count);
+    }
+
+    void Submit(std::function<void()> task)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        queue_.push_back(std::move(task));
+        if (queue_.size() > idle_ && threads_.size() < thread_count_)
+        {
+            threads_.emplace_back([this]()
+                                  { Run(); });
+        }
+        wake_.notify_one();
+    }
+
+    // Waits for the completion of the queued tasks, then stops the workers
+    void Stop()
+    {
+        std::vector<std::thread> threads;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+            threads.swap(threads_);
+        }
+        wake_.notify_all();
+        for (auto &thread : threads)
+        {
+            thread.join();
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = false;
+    }
+
+private:
+    void Run()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true)
+        {
+            idle_++;
+            wake_.wait(lock, [this]()
+                       { return stopping_ || !queue_.empty(); });
+            idle_--;
+            if (queue_.empty())
+            {
+                return;
+            }
+            std::function<void()> task = std::move(queue_.front());
+            queue_.pop_front();
+            lock.unlock();
+            task();
+            lock.lock();
+        }
+    }
+
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::deque<std::function<void()>> queue_;
+    std::vector<std::thread> threads_;
+    size_t thread_count_{16};
+    size_t idle_{0};
+    bool stopping_{false};
+};
+
+BackgroundPool background_pool;
+
+// Workers of the requests a driver call splits and waits for, bounded whatever the number of concurrent
+// calls. Separate from background_pool, so that a call never waits for its own requests queued behind
+// background tasks, nor background tasks behind such requests.
+BackgroundPool parallel_pool;
+
+// Unlike std::async, the returned future does not block on destruction: an abandoned task keeps
+// running until completion, owning whatever its callable captured.
+template <typename T>
+std::future<T> LaunchInPool(BackgroundPool &pool, std::function<T()> task)
+{
+    // std::function needs a copyable callable
+    auto packaged = std::make_shared<std::packaged_task<T()>>(std::move(task));
+    std::future<T> result = packaged->get_future();
+    // the task works for the same stream handle as its caller
+    const void *handle = trace_handle;
+    pool.Submit([packaged, handle]()
+                {
+                    TraceHandleScope trace_scope(handle);
+                    (*packaged)(); });
+    return result;
+}
+
+template <typename T>
+std::future<T> LaunchInBackground(std::function<T()> task)
+{
+    return LaunchInPool(background_pool, std::move(task));
+}
+
+void WaitForBackgroundTasks()
+{
+    parallel_pool.Stop();
+    background_pool.Stop();
+}
+
+// Reads larger than this threshold are split into concurrent range downloads, 0 disables the split
+tOffset parallel_read_threshold{16 * 1024 * 1024};
+size_t parallel_read_concurrency{8};
+
+// Same as ReadBytesAt, but a large read is split into up to parallel_read_concurrency sub-ranges of at least
+// preferred_buffer_size bytes, downloaded concurrently, each one straight into its own slice of buffer.
+long long ReadBytesAtParallel(const MultiPartFile &multifile, tOffset offset, char *buffer, tOffset to_read)
+{
+    const tOffset max_slices = to_read / preferred_buffer_size;
+    if (0 == parallel_read_threshold || to_read <= parallel_read_threshold || parallel_read_concurrency < 2 || max_slices < 2)
+    {
+        return ReadBytesAt(multifile, offset, buffer, to_read);
+    }
+
+    const size_t slice_count = static_cast<size_t>(std::min(static_cast<tOffset>(parallel_read_concurrency), max_slices));
+    const tOffset slice_size = (to_read + static_cast<tOffset>(slice_count) - 1) / static_cast<tOffset>(slice_count);
+
+    spdlog::debug("Split read of {} bytes @ {} in {} ranges", to_read, offset, slice_count);
+
+    std::vector<tOffset> slice_sizes;
+    std::vector<std::future<long long>> slices;
+    for (tOffset start = 0; start < to_read; start += slice_size)
+    {
+        const tOffset length = std::min(slice_size, to_read - start);
+        slice_sizes.push_back(length);
+        slices.push_back(LaunchInPool<long long>(parallel_pool, [&multifile, offset, buffer, start, length]()
+                                                 { return ReadBytesAt(multifile, offset + start, buffer + start, length); }));
+    }
+
+    // wait for all the slices before returning, since they all write to the caller buffer
+    long long num_read{0};
+    bool short_read{false};
+    std::exception_ptr error;
+    for (size_t i = 0; i < slices.size(); i++)
+    {
+        try
+        {
+            const long long slice_read = slices[i].get();
+            if (!short_read)
+            {
+                // only the bytes before the first short slice are contiguous
+                num_read += slice_read;
+                short_read = slice_read < slice_sizes[i];
+            }
+        }
+        catch (...)
+        {
+            if (!error)
+            {
+                error = std::current_exception();
+            }
+        }
+    }
+
+    if (error)
+    {
+        std::rethrow_exception(error);
+    }
+    return num_read;
+}
+
+// Maximum number of chunks downloaded ahead of a sequential reader, 0 disables read-ahead
+size_t read_ahead_max_window{8};
+// Maximum size of a chunk downloaded ahead, and of all the bytes downloaded ahead of a reader
+tOffset read_ahead_max_chunk_size{16 * 1024 * 1024};
+tOffset read_ahead_max_bytes{64 * 1024 * 1024};
+
+namespace azureplugin
+{
+    // A chunk dropped before its download started, since the reader moved elsewhere or was closed, cancels
+    // the download, so that abandoned chunks do not hold the background workers.
+    struct ReadAheadChunk
+    {
+        tOffset start;
+        std::shared_ptr<std::vector<char>> data;
+        std::future<long long> pending;
+        long long size{-1}; // bytes actually downloaded, -1 until the download completed
+        tOffset pos{0};     // bytes already served to the reader
+        std::shared_ptr<std::atomic<bool>> cancelled{std::make_shared<std::atomic<bool>>(false)};
+
+        ReadAheadChunk() = default;
+        ReadAheadChunk(ReadAheadChunk &&) = default;
+        ReadAheadChunk &operator=(ReadAheadChunk &&) = default;
+        ~ReadAheadChunk()
+        {
+            if (cancelled)
+            {
+                *cancelled = true;
+            }
+        }
+    };
+
+    // Read-ahead state of a reader handle.
+    // Sequential reads, each one starting where the previous ended, double the window of background
+    // downloads up to read_ahead_max_window; any other access drops the window back to zero.
+    struct ReadAhead
+    {
+        std::shared_ptr<const MultiPartFile> source; // immutable copy of the reader, shared with the downloads
+        tOffset next_offset{-1};
+        size_t window{0};
+        std::deque<ReadAheadChunk> chunks;
+    };
+}
+
+// Copies to buffer the bytes already downloaded ahead at offset, returns the number of bytes copied
+long long ServeFromReadAhead(ReadAhead &read_ahead, tOffset offset, char *buffer, tOffset to_read)
+{
+    auto &chunks = read_ahead.chunks;
+    tOffset served{0};
+
+    while (served < to_read && !chunks.empty())
+    {
+        ReadAheadChunk &chunk = chunks.front();
+        if (chunk.start + chunk.pos != offset + served)
+        {
+            chunks.clear();
+            break;
+        }
+
+        if (chunk.size < 0)
+        {
+            try
+            {
+                chunk.size = chunk.pending.get();
+            }
+            catch (const std::exception &e)
+            {
+                // let the direct read retry and report the error if it persists
+                spdlog::debug("Read ahead failed: {}", e.what());
+                chunks.clear();
+                read_ahead.window = 0;
+                break;
+            }
+        }
+
+        const tOffset to_copy = std::min(to_read - served, chunk.size - chunk.pos);
+        std::memcpy(buffer + served, chunk.data->data() + chunk.pos, static_cast<size_t>(to_copy));
+        served += to_copy;
+        chunk.pos += to_copy;
+
+        if (chunk.pos == chunk.size)
+        {
+            const bool end_of_file = chunk.size < static_cast<tOffset>(chunk.data->size());
+            chunks.pop_front();
+            if (end_of_file)
+            {
+                chunks.clear();
+                break;
+            }
+        }
+    }
+
+    return served;
+}
+
+void ScheduleReadAhead(const MultiPartFile &multifile, ReadAhead &read_ahead, tOffset chunk_size)
+{
+    auto &chunks = read_ahead.chunks;
+    if (chunks.size() >= read_ahead.window)
+    {
+        return;
+    }
+
+    if (!read_ahead.source)
+    {
+        auto source = std::make_shared<MultiPartFile>(multifile);
+        source->readAhead_.reset();
+        source->readStream_.reset();
+        read_ahead.source = std::move(source);
+    }
+
+    tOffset next = chunks.empty() ? multifile.offset_ : chunks.back().start + static_cast<tOffset>(chunks.back().data->size());
+    tOffset ahead{0};
+    for (const auto &chunk : chunks)
+    {
+        ahead += static_cast<tOffset>(chunk.data->size()) - chunk.pos;
+    }
+    chunk_size = std::min(chunk_size, read_ahead_max_chunk_size);
+
+    while (chunks.size() < read_ahead.window && next < multifile.total_size_ && ahead < read_ahead_max_bytes)
+    {
+        const tOffset length = std::min({chunk_size, multifile.total_size_ - next, read_ahead_max_bytes - ahead});
+        auto data = std::make_shared<std::vector<char>>(static_cast<size_t>(length));
+        std::shared_ptr<const MultiPartFile> source = read_ahead.source;
+
+        ReadAheadChunk chunk;
+        chunk.start = next;
+        chunk.data = data;
+        std::shared_ptr<const std::atomic<bool>> cancelled = chunk.cancelled;
+        chunk.pending = LaunchInBackground<long long>([source, data, next, cancelled]()
+                                                      { return *cancelled ? 0LL : ReadBytesAt(*source, next, data->data(), static_cast<tOffset>(data->size())); });
+        chunks.push_back(std::move(chunk));
+
+        next += length;
+        ahead += length;
+    }
+}
+
+// When set, reader handles stream their parts instead of downloading a range per read
+bool streaming_read{false};
+
+namespace azureplugin
+{
+    // Streaming state of a reader handle: the body of a download running from the current offset to the
+    // end of a part. Consecutive reads take their bytes from it, a read at any other offset opens a new one.
+    struct ReadStream
+    {
+        std::unique_ptr<Azure::Core::IO::BodyStream> body;
+        tOffset next_offset{-1}; // logical offset of the next byte of body
+        tOffset end_offset{0};   // logical offset of the end of the part
+    };
+}
+
+// Opens the download of the part holding the logical offset, from offset to the end of the part.
+// As for ranged reads, the download fails if the part was modified since the reader was opened.
+void OpenReadStream(const MultiPartFile &multifile, tOffset offset, ReadStream &stream)
+{
+    stream.body.reset();
+
+    const PartManifest &parts = *multifile.parts_;
+    tOffset part_start{0};
+    const size_t idx = parts.FindPart(offset, part_start);
+    if (idx >= parts.Count())
+    {
+        throw std::runtime_error("Cannot stream beyond the end of the file");
+    }
+
+    const tOffset file_start = (idx == 0) ? offset : offset - part_start + multifile.commonHeaderLength_;
+    const tOffset length = part_start + parts.PartSize(idx) - offset;
+    const std::string &etag = parts.ETag(idx);
+
+    spdlog::debug("Stream item {} from {} ({} bytes)", idx, file_start, length);
+
+    Azure::Core::Http::HttpRange range;
+    range.Offset = file_start;
+    range.Length = length;
+
+    if (SHARE == multifile.service_)
+    {
+        DownloadFileOptions options;
+        options.Range = range;
+        auto response = multifile.clients_ ? multifile.clients_->files[idx].Download(options)
+                                           : GetShareFileClient(multifile.bucketname_, parts.Name(idx)).Download(options);
+        if (!etag.empty() && response.Value.Details.ETag.ToString() != etag)
+        {
+            throw MakeRequestFailedException(Azure::Core::Http::HttpStatusCode::PreconditionFailed, "The file was modified since it was opened: " + parts.Name(idx));
+        }
+        stream.body = std::move(response.Value.BodyStream);
+    }
+    else
+    {
+        DownloadBlobOptions options;
+        options.Range = range;
+        if (!etag.empty())
+        {
+            options.AccessConditions.IfMatch = Azure::ETag(etag);
+        }
+        auto response = multifile.clients_ ? multifile.clients_->blobs[idx].Download(options)
+                                           : GetBlockBlobClient(multifile.bucketname_, parts.Name(idx)).Download(options);
+        stream.body = std::move(response.Value.BodyStream);
+    }
+
+    stream.next_offset = offset;
+    stream.end_offset = offset + length;
+}
+
+// Same as ReadBytesInFile, the bytes coming from the download stream of the reader, which goes on from
+// one read to the next. A new stream is opened at each part, and whenever the offset was moved.
+long long ReadBytesFromStream(MultiPartFile &multifile, char *buffer, tOffset to_read)
+{
+    if (!multifile.readStream_)
+    {
+        multifile.readStream_ = std::make_shared<ReadStream>();
+    }
+    ReadStream &stream = *multifile.readStream_;
+
+    tOffset offset = multifile.offset_;
+    long long num_read{0};
+    try
+    {
+        while (num_read < to_read && offset < multifile.total_size_)
+        {
+            if (!stream.body || stream.next_offset != offset)
+            {
+                OpenReadStream(multifile, offset, stream);
+            }
+
+            const tOffset length = std::min(to_read - num_read, stream.end_offset - offset);
+            const tOffset received = static_cast<tOffset>(
+                stream.body->ReadToCount(reinterpret_cast<uint8_t *>(buffer + num_read), static_cast<size_t>(length)));
+            num_read += received;
+            offset += received;
+            stream.next_offset = offset;
+
+            if (received < length)
+            {
+                spdlog::debug("End of file encountered");
+                stream.body.reset();
+                break;
+            }
+            if (offset == stream.end_offset)
+            {
+                // the next part needs its own download
+                stream.body.reset();
+            }
+        }
+    }
+    catch (...)
+    {
+        // the position of the body is unknown, the next read starts over from the offset
+        stream.body.reset();
+        throw;
+    }
+
+    multifile.offset_ = offset;
+    return num_read;
+}
+
+// Reads to_read bytes at the current offset of multifile and advances the offset by the number of bytes read.
+// Sequential reads are served from the read-ahead buffers, the missing bytes being downloaded directly.
+// In streaming mode, all the reads go through the download stream of the reader instead.
+long long ReadBytesInFile(MultiPartFile &multifile, char *buffer, tOffset to_read)
+{
+    if (streaming_read)
+    {
+        return ReadBytesFromStream(multifile, buffer, to_read);
+    }
+
+    const tOffset offset = multifile.offset_;
+
+    if (0 == read_ahead_max_window)
+    {
+        const long long num_read = ReadBytesAtParallel(multifile, offset, buffer, to_read);
+        multifile.offset_ += num_read;
+        return num_read;
+    }
+
+    if (!multifile.readAhead_)
+    {
+        multifile.readAhead_ = std::make_shared<ReadAhead>();
+    }
+    ReadAhead &read_ahead = *multifile.readAhead_;
+
+    if (offset == read_ahead.next_offset)
+    {
+        read_ahead.window = std::min(read_ahead_max_window, std::max<size_t>(1, 2 * read_ahead.window));
+    }
+    else
+    {
+        read_ahead.window = 0;
+        read_ahead.chunks.clear();
+    }
+
+    long long num_read = ServeFromReadAhead(read_ahead, offset, buffer, to_read);
+    if (num_read < to_read)
+    {
+        num_read += ReadBytesAtParallel(multifile, offset + num_read, buffer + num_read, to_read - num_read);
+    }
+
+    multifile.offset_ = offset + num_read;
+    read_ahead.next_offset = multifile.offset_;
+
+    ScheduleReadAhead(multifile, read_ahead, std::max(to_read, preferred_buffer_size));
+
+    return num_read;
+}
+
+// Size of the first range read when looking for the header line of a part
+constexpr tOffset header_probe_size{4 * 1024};
+
+// Maximum number of header probes in flight when opening a multi-part file
+size_t header_probe_concurrency{16};
+
+// Reads the first line of an object, including the end of line character if any, with ranged reads
+// of the beginning of the object. An empty object has an empty header.
+std::string ReadHeader(const std::string &bucket_name, const std::string &filename, const std::string &etag, tOffset size)
+{
+    std::string line;
+    tOffset probe_size = header_probe_size;
+    while (static_cast<tOffset>(line.size()) < size)
+    {
+        const tOffset start = static_cast<tOffset>(line.size());
+        const tOffset end = std::min(size, start + probe_size);
+        std::vector<char> buffer(static_cast<size_t>(end - start));
+        const long long num_read = DownloadFileRangeToBuffer(bucket_name, filename, etag, buffer.data(), start, end);
+        if (num_read <= 0)
+        {
+            break;
+        }
+
+        const auto buffer_end = buffer.begin() + num_read;
+        const auto line_end = std::find(buffer.begin(), buffer_end, '\n');
+        if (line_end != buffer_end)
+        {
+            line.append(buffer.begin(), line_end + 1);
+            break;
+        }
+        line.append(buffer.begin(), buffer_end);
+
+        // the line goes on past the probe, look further
+        probe_size *= 2;
+    }
+    return line;
+}
+
+// Tells whether all the parts but the first start with header. The parts are probed concurrently,
+// and the probing stops at the first mismatch.
+bool OtherPartsShareHeader(const std::string &bucket_name,
+                           const std::vector<std::string> &filenames,
+                           const std::vector<std::string> &etags,
+                           const std::vector<long long> &sizes,
+                           const std::string &header)
+{
+    const size_t part_count = filenames.size();
+    std::atomic<size_t> next_part{1};
+    std::atomic<bool> mismatch{false};
+    auto probe_parts = [&]()
+    {
+        for (size_t part = next_part++; part < part_count && !mismatch; part = next_part++)
+        {
+            if (sizes[part] < static_cast<long long>(header.size()) ||
+                header != ReadHeader(bucket_name, filenames[part], etags[part], static_cast<tOffset>(header.size())))
+            {
+                mismatch = true;
+            }
+        }
+    };
+
+    const size_t worker_count = std::max<size_t>(1, std::min(header_probe_concurrency, part_count - 1));
+    std::vector<std::future<void>> workers;
+    for (size_t i = 0; i < worker_count; i++)
+    {
+        workers.push_back(LaunchInPool<void>(parallel_pool, probe_parts));
+    }
+
+    std::exception_ptr error;
+    for (auto &worker : workers)
+    {
+        try
+        {
+            worker.get();
+        }
+        catch (...)
+        {
+            mismatch = true;
+            if (!error)
+            {
+                error = std::current_exception();
+            }
+        }
+    }
+    if (error)
+    {
+        std::rethrow_exception(error);
+    }
+    return !mismatch;
+}
+
+// Size of the blocks staged by the writers
+tOffset write_block_size{8 * 1024 * 1024};
+
+// Maximum number of block uploads in flight per writer
+size_t write_max_concurrency{8};
+
+// Maximum number of deletions in a blob batch request
+constexpr size_t max_delete_batch_size{256};
+
+// Maximum number of blob batch requests in flight when deleting many blobs
+size_t delete_batch_concurrency{4};
+
+// Limits of a block blob: number of blocks in its block list and size of a block
+constexpr size_t max_block_count{50000};
+constexpr tOffset max_block_size{4000LL * 1024 * 1024};
+
+// The block size doubles every this many blocks, so that the block count limit is not hit before
+// several terabytes have been written
+constexpr size_t block_count_per_size_step{10000};
+
+namespace azureplugin
+{
+    // Upload state of a writer handle.
+    // Written bytes accumulate in buffer; each full buffer is staged as an uncommitted block in the
+    // background while the caller keeps writing. Closing the writer commits the list of the staged
+    // blocks, which is when the blob gets its new content.
+    // When appending, the staged blocks are committed after the blocks already committed in the blob,
+    // on the condition that the blob did not change since the writer was opened.
+    struct BlockUpload
+    {
+        BlockBlobClient client;
+        std::string id_prefix; // unique to the upload, so that concurrent writers do not mix their blocks
+        std::vector<std::string> committed_ids;
+        Azure::ETag base_etag;
+        std::vector<std::string> block_ids;
+        std::vector<char> buffer;
+        size_t first_block_size{0};
+        size_t block_size{0};
+        std::deque<std::future<void>> pending;
+        bool failed{false}; // a block could not be staged, the upload can only be abandoned
+        // Set by PrepareAppend when the committed content has to be staged again ahead of the first
+        // appended block, as restage_size bytes of the blob object_name of bucket_name
+        bool restage{false};
+        tOffset restage_size{0};
+        std::string bucket_name;
+        std::string object_name;
+    };
+}
+
+std::string MakeUploadId()
+{
+    static std::mutex mutex;
+    static std::mt19937_64 generator{std::random_device{}()};
+
+    std::lock_guard<std::mutex> lock(mutex);
+    std::ostringstream os;
+    os << std::hex << std::setw(16) << std::setfill('0') << generator();
+    return os.str();
+}
+
+// Azure requires the ids of the blocks of a blob to have the same length, hence the fixed width index
+std::string MakeBlockId(const std::string &id_prefix, size_t index)
+{
+    std::ostringstream os;
+    os << id_prefix << std::setw(6) << std::setfill('0') << index;
+    const std::string raw_id = os.str();
+    return Azure::Core::Convert::Base64Encode(std::vector<uint8_t>(raw_id.begin(), raw_id.end()));
+}
+
+size_t BlockSizeAt(size_t first_block_size, size_t block_count)
+{
+    tOffset block_size{static_cast<tOffset>(first_block_size)};
+    for (size_t step = block_count / block_count_per_size_step; step > 0 && block_size < max_block_size; step--)
+    {
+        block_size *= 2;
+    }
+    return static_cast<size_t>(std::min(block_size, max_block_size));
+}
+
+std::shared_ptr<BlockUpload> MakeBlockUpload(BlockBlobClient client, size_t first_block_size)
+{
+    auto upload = std::make_shared<BlockUpload>();
+    upload->client = std::move(client);
+    upload->id_prefix = MakeUploadId();
+    upload->first_block_size = first_block_size;
+    upload->block_size = first_block_size;
+    return upload;
+}
+
+// Waits for the oldest uploads until at most max_pending are in flight, rethrows the first error
+void WaitForPendingUploads(std::deque<std::future<void>> &pending, size_t max_pending, bool &failed)
+{
+    std::exception_ptr error;
+    while (pending.size() > max_pending)
+    {
+        std::future<void> upload = std::move(pending.front());
+        pending.pop_front();
+        try
+        {
+            upload.get();
+        }
+        catch (...)
+        {
+            if (!error)
+            {
+                error = std::current_exception();
+            }
+        }
+    }
+
+    if (error)
+    {
+        failed = true;
+        std::rethrow_exception(error);
+    }
+}
+
+void WaitForStagedBlocks(BlockUpload &upload, size_t max_pending)
+{
+    WaitForPendingUploads(upload.pending, max_pending, upload.failed);
+}
+
+void RestageContent(BlockUpload &upload);
+
+void StageBufferedBlock(BlockUpload &upload)
+{
+    if (upload.restage)
+    {
+        RestageContent(upload);
+    }
+
+    const size_t block_count = upload.committed_ids.size() + upload.block_ids.size();
+    if (block_count >= max_block_count)
+    {
+        throw std::runtime_error("Too many blocks, a blob cannot be made of more than " + std::to_string(max_block_count) + " blocks");
+    }
+
+    // keep the number of uploads in flight bounded, the caller produces data faster than it can be sent
+    WaitForStagedBlocks(upload, std::max<size_t>(write_max_concurrency, 1) - 1);
+
+    auto data = std::make_shared<std::vector<char>>(std::move(upload.buffer));
+    const std::string block_id = MakeBlockId(upload.id_prefix, upload.block_ids.size());
+    upload.block_ids.push_back(block_id);
+    upload.block_size = BlockSizeAt(upload.first_block_size, block_count + 1);
+    upload.buffer = std::vector<char>();
+    upload.buffer.reserve(upload.block_size);
+
+    const BlockBlobClient client = upload.client;
+    upload.pending.push_back(LaunchInBackground<void>([client, block_id, data]()
+                                                      {
+        Azure::Core::IO::MemoryBodyStream body(reinterpret_cast<const uint8_t *>(data->data()), data->size());
+        client.StageBlock(block_id, body); }));
+}
+
+void CheckUploadNotFailed(const BlockUpload &upload)
+{
+    if (upload.failed)
+    {
+        throw std::runtime_error("A previous block upload failed, the written data is lost");
+    }
+}
+
+void WriteToUpload(BlockUpload &upload, const char *data, size_t size)
+{
+    CheckUploadNotFailed(upload);
+
+    while (size > 0)
+    {
+        const size_t to_copy = std::min(size, upload.block_size - upload.buffer.size());
+        upload.buffer.insert(upload.buffer.end(), data, data + to_copy);
+        data += to_copy;
+        size -= to_copy;
+
+        if (upload.buffer.size() >= upload.block_size)
+        {
+            StageBufferedBlock(upload);
+        }
+    }
+}
+
+void CommitUpload(BlockUpload &upload)
+{
+    CheckUploadNotFailed(upload);
+
+    const bool appending = upload.base_etag.HasValue();
+    if (appending && upload.block_ids.empty() && upload.buffer.empty())
+    {
+        // nothing appended, leave the blob untouched
+        return;
+    }
+
+    if (!upload.buffer.empty())
+    {
+        StageBufferedBlock(upload);
+    }
+    WaitForStagedBlocks(upload, 0);
+
+    std::vector<std::string> block_ids{upload.committed_ids};
+    block_ids.insert(block_ids.end(), upload.block_ids.begin(), upload.block_ids.end());
+
+    // when appending, a concurrent modification of the blob makes the commit fail instead of being lost
+    CommitBlockListOptions options;
+    if (appending)
+    {
+        options.AccessConditions.IfMatch = upload.base_etag;
+    }
+    upload.client.CommitBlockList(block_ids, options);
+}
+
+// Largest block staged from a range of another blob
+constexpr tOffset max_copy_block_size{100 * 1024 * 1024};
+
+// Value of a setting of a connection string, empty if it has none
+std::string GetConnectionStringValue(const std::string &connection_string, const std::string &name)
+{
+    std::istringstream settings(connection_string);
+    std::string setting;
+    while (std::getline(settings, setting, ';'))
+    {
+        const size_t equal = setting.find('=');
+        if (equal != std::string::npos && setting.compare(0, equal, name) == 0)
+        {
+            return setting.substr(equal + 1);
+        }
+    }
+    return {};
+}
+
+// URL under which the service can read a blob as the source of a copy: the blob URL when it holds the SAS
+// of the connection string already, else with a short-lived read-only SAS signed with the account key.
+std::string MakeCopySourceUrl(const BlockBlobClient &client, const std::string &bucket_name, const std::string &object_name)
+{
+    const std::string url = client.GetUrl();
+    const std::string connection_string = GetConnectionStringOrDefault();
+    const std::string account_name = GetConnectionStringValue(connection_string, "AccountName");
+    const std::string account_key = GetConnectionStringValue(connection_string, "AccountKey");
+    if (url.find('?') != std::string::npos || account_name.empty() || account_key.empty())
+    {
+        return url;
+    }
+
+    Sas::BlobSasBuilder builder;
+    // only the storage emulator is reached over plain HTTP
+    builder.Protocol = url.compare(0, 7, "http://") == 0 ? Sas::SasProtocol::HttpsAndHttp : Sas::SasProtocol::HttpsOnly;
+    builder.ExpiresOn = Azure::DateTime(std::chrono::system_clock::now() + std::chrono::hours(1));
+    builder.BlobContainerName = bucket_name;
+    builder.BlobName = object_name;
+    builder.Resource = Sas::BlobSasResource::Blob;
+    builder.SetPermissions(Sas::BlobSasPermissions::Read);
+    return url + builder.GenerateSasToken(StorageSharedKeyCredential(account_name, account_key));
+}
+
+// Stages the content of the blob of upload as blocks copied by the service from ranges of the blob itself,
+// write_max_concurrency at a time. The copy fails if the blob is modified meanwhile.
+void StageContentFromUri(BlockUpload &upload, const std::string &source_url, const Azure::ETag &etag, tOffset size)
+{
+    std::vector<std::string> block_ids;
+    std::deque<std::future<void>> pending;
+    bool failed{false};
+    for (tOffset start = 0; start < size; start += max_copy_block_size)
+    {
+        WaitForPendingUploads(pending, std::max<size_t>(write_max_concurrency, 1) - 1, failed);
+
+        const std::string block_id = MakeBlockId(upload.id_prefix, block_ids.size());
+        block_ids.push_back(block_id);
+        StageBlockFromUriOptions options;
+        Azure::Core::Http::HttpRange range;
+        range.Offset = start;
+        range.Length = std::min(max_copy_block_size, size - start);
+        options.SourceRange = range;
+        options.SourceAccessConditions.IfMatch = etag;
+
+        const BlockBlobClient client = upload.client;
+        pending.push_back(LaunchInBackground<void>([client, block_id, source_url, options]()
+                                                   { client.StageBlockFromUri(block_id, source_url, options); }));
+    }
+    WaitForPendingUploads(pending, 0, failed);
+
+    upload.block_ids = std::move(block_ids);
+    upload.block_size = BlockSizeAt(upload.first_block_size, upload.block_ids.size());
+}
+
+// Prepares upload to append to its blob: the new blocks will follow the blocks already committed.
+// A blob that was not uploaded as blocks, or whose block ids have another length than ours, has its
+// content staged again once, ahead of the first appended block (see RestageContent); the next appends
+// extend its block list.
+void PrepareAppend(BlockUpload &upload, const std::string &bucket_name, const std::string &object_name)
+{
+    Blobs::Models::GetBlockListResult block_list;
+    try
+    {
+        block_list = upload.client.GetBlockList().Value;
+    }
+    catch (const Azure::Core::RequestFailedException &e)
+    {
+        if (e.StatusCode == Azure::Core::Http::HttpStatusCode::NotFound)
+        {
+            // appending to a missing blob creates it
+            return;
+        }
+        throw;
+    }
+
+    upload.base_etag = block_list.ETag;
+
+    const size_t id_length = MakeBlockId(upload.id_prefix, 0).size();
+    const auto &committed = block_list.CommittedBlocks;
+    const bool extendable = !committed.empty() && std::all_of(committed.begin(), committed.end(), [id_length](const Blobs::Models::BlobBlock &block)
+                                                                  { return block.Name.size() == id_length; });
+    if (extendable)
+    {
+        for (const auto &block : committed)
+        {
+            upload.committed_ids.push_back(block.Name);
+        }
+        return;
+    }
+
+    // staged on the first block appended, so that appending nothing leaves the blob untouched
+    upload.restage = true;
+    upload.restage_size = static_cast<tOffset>(block_list.BlobSize);
+    upload.bucket_name = bucket_name;
+    upload.object_name = object_name;
+}
+
+// Stages the content of the blob of upload through the client, write_block_size bytes at a time
+void StageContentThroughClient(BlockUpload &upload, const Azure::ETag &etag, tOffset size)
+{
+    std::vector<std::string> block_ids;
+    std::deque<std::future<void>> pending;
+    bool failed{false};
+    for (tOffset start = 0; start < size; start += write_block_size)
+    {
+        WaitForPendingUploads(pending, std::max<size_t>(write_max_concurrency, 1) - 1, failed);
+
+        const tOffset end = std::min(start + write_block_size, size);
+        auto data = std::make_shared<std::vector<char>>(static_cast<size_t>(end - start));
+        if (DownloadFileRangeToBuffer(upload.client, etag.ToString(), data->data(), start, end) != end - start)
+        {
+            throw std::runtime_error("Unexpected end of blob while staging its content for append");
+        }
+
+        const std::string block_id = MakeBlockId(upload.id_prefix, block_ids.size());
+        block_ids.push_back(block_id);
+        const BlockBlobClient client = upload.client;
+        pending.push_back(LaunchInBackground<void>([client, block_id, data]()
+                                                   {
+            Azure::Core::IO::MemoryBodyStream body(reinterpret_cast<const uint8_t *>(data->data()), data->size());
+            client.StageBlock(block_id, body); }));
+    }
+    WaitForPendingUploads(pending, 0, failed);
+
+    upload.block_ids = std::move(block_ids);
+    upload.block_size = BlockSizeAt(upload.first_block_size, upload.block_ids.size());
+}
+
+// Stages again the committed content of the blob of upload, ahead of the appended blocks.
+// The service copies it from the blob itself; only if the service is not allowed to read the blob does the
+// content go through the client.
+void RestageContent(BlockUpload &upload)
+{
+    upload.restage = false;
+    try
+    {
+        StageContentFromUri(upload, MakeCopySourceUrl(upload.client, upload.bucket_name, upload.object_name), upload.base_etag, upload.restage_size);
+        return;
+    }
+    catch (const Azure::Core::RequestFailedException &e)
+    {
+        if (e.StatusCode != Azure::Core::Http::HttpStatusCode::Unauthorized && e.StatusCode != Azure::Core::Http::HttpStatusCode::Forbidden)
+        {
+            upload.failed = true;
+            throw;
+        }
+        spdlog::debug("The service cannot read the blob to append to, staging it through the client: {}", e.what());
+    }
+    catch (...)
+    {
+        upload.failed = true;
+        throw;
+    }
+
+    try
+    {
+        StageContentThroughClient(upload, upload.base_etag, upload.restage_size);
+    }
+    catch (...)
+    {
+        upload.failed = true;
+        throw;
+    }
+}
+
+// Largest range of a single UploadRange request to a file share
+constexpr tOffset max_file_range_size{4 * 1024 * 1024};
+
+// A file of a share being written grows ahead of the writes by doubling, by at most this much at once
+constexpr tOffset max_file_growth{1024LL * 1024 * 1024};
+
+namespace azureplugin
+{
+    // Upload state of a writer handle on a file share.
+    // Unlike block blobs, the files of a share support random writes: each full buffer is written in
+    // place with UploadRange in the background, up to write_max_concurrency ranges in flight, while the
+    // caller keeps writing. The file is grown ahead of the ranges and set to its actual size when flushed
+    // or closed.
+    struct RangeUpload
+    {
+        ShareFileClient client;
+        std::string share_name;
+        tOffset offset{0}; // where the buffered bytes go in the file
+        tOffset file_size{0};
+        std::vector<char> buffer;
+        size_t range_size{0};
+        std::deque<std::future<void>> pending;
+        bool failed{false}; // a range could not be written, the content of the file is unknown
+    };
+}
+
+std::shared_ptr<RangeUpload> MakeRangeUpload(ShareFileClient client, std::string share_name, tOffset offset, tOffset file_size)
+{
+    auto upload = std::make_shared<RangeUpload>();
+    upload->client = std::move(client);
+    upload->share_name = std::move(share_name);
+    upload->offset = offset;
+    upload->file_size = file_size;
+    upload->range_size = static_cast<size_t>(std::min(write_block_size, max_file_range_size));
+    return upload;
+}
+
+// Size of a file of a share, 0 if it does not exist
+tOffset GetShareFileSizeOrZero(const ShareFileClient &client)
+{
+    try
+    {
+        return static_cast<tOffset>(client.GetProperties().Value.FileSize);
+    }
+    catch (const Azure::Core::RequestFailedException &e)
+    {
+        if (e.StatusCode != Azure::Core::Http::HttpStatusCode::NotFound)
+        {
+            throw;
+        }
+        return 0;
+    }
+}
+
+void ResizeShareFile(const ShareFileClient &client, tOffset size)
+{
+    SetFilePropertiesOptions options;
+    options.Size = size;
+    client.SetProperties(Files::Shares::Models::FileHttpHeaders(), Files::Shares::Models::FileSmbProperties(), options);
+}
+
+void CheckUploadNotFailed(const RangeUpload &upload)
+{
+    if (upload.failed)
+    {
+        throw std::runtime_error("A previous range upload failed, the content of the file is unknown");
+    }
+}
+
+void UploadBufferedRange(RangeUpload &upload)
+{
+    WaitForPendingUploads(upload.pending, std::max<size_t>(write_max_concurrency, 1) - 1, upload.failed);
+
+    const tOffset end = upload.offset + static_cast<tOffset>(upload.buffer.size());
+    if (end > upload.file_size)
+    {
+        const tOffset new_size = std::max(end, upload.file_size + std::min(upload.file_size, max_file_growth));
+        ResizeShareFile(upload.client, new_size);
+        upload.file_size = new_size;
+    }
+
+    auto data = std::make_shared<std::vector<char>>(std::move(upload.buffer));
+    const tOffset offset = upload.offset;
+    upload.offset = end;
+    upload.buffer = std::vector<char>();
+    upload.buffer.reserve(upload.range_size);
+    share_free_space.Consume(upload.share_name, static_cast<long long>(data->size()));
+
+    const ShareFileClient client = upload.client;
+    upload.pending.push_back(LaunchInBackground<void>([client, offset, data]()
+                                                      {
+        Azure::Core::IO::MemoryBodyStream body(reinterpret_cast<const uint8_t *>(data->data()), data->size());
+        client.UploadRange(offset, body); }));
+}
+
+void WriteToRangeUpload(RangeUpload &upload, const char *data, size_t size)
+{
+    CheckUploadNotFailed(upload);
+
+    while (size > 0)
+    {
+        const size_t to_copy = std::min(size, upload.range_size - upload.buffer.size());
+        upload.buffer.insert(upload.buffer.end(), data, data + to_copy);
+        data += to_copy;
+        size -= to_copy;
+
+        if (upload.buffer.size() >= upload.range_size)
+        {
+            UploadBufferedRange(upload);
+        }
+    }
+}
+
+// Writes everything buffered so far and gives the file its actual size
+void FlushRangeUpload(RangeUpload &upload)
+{
+    CheckUploadNotFailed(upload);
+
+    if (!upload.buffer.empty())
+    {
+        UploadBufferedRange(upload);
+    }
+    WaitForPendingUploads(upload.pending, 0, upload.failed);
+
+    if (upload.file_size != upload.offset)
+    {
+        ResizeShareFile(upload.client, upload.offset);
+        upload.file_size = upload.offset;
+    }
+}
+
+// pre condition: stream is of a writing type. do not call otherwise.
+void CloseWriterStream(Handle &stream)
+{
+    const WriteFile &writer = stream.GetWriter();
+    if (writer.range_upload_)
+    {
+        FlushRangeUpload(*writer.range_upload_);
+    }
+    else
+    {
+        CommitUpload(*writer.upload_);
+    }
+
+    InvalidateCachedObject(writer.bucketname_, writer.filename_);
+}
+
+// Implementation of driver functions
+/*
+void test_setClient(::google::cloud::storage::Client &&mock_client)
+{
+    client = std::move(mock_client);
+    bIsConnected = kTrue;
+}
+
+void test_unsetClient()
+{
+    client = ::google::cloud::storage::Client{};
+}
+
+void *test_getActiveHandles()
+{
+    return &active_handles;
+}
+
+void *test_addReaderHandle(
+    const std::string &bucket,
+    const std::string &object,
+    long long offset,
+    long long commonHeaderLength,
+    const std::vector<std::string> &filenames,
+    const std::vector<long long int> &cumulativeSize,
+    long long total_size)
+{
+    ReaderPtr reader_ptr{new MultiPartFile{
+        bucket,
+        object,
+        offset,
+        commonHeaderLength,
+        std::make_shared<PartManifest>(filenames, cumulativeSize),
+        total_size}};
+    return InsertHandle<ReaderPtr, HandleType::kRead>(std::move(reader_ptr));
+}
+
+void *test_addWriterHandle(bool appendMode, bool create_with_mock_client, std::string bucketname, std::string objectname)
+{
+    if (!create_with_mock_client)
+    {
+        if (appendMode)
+        {
+            return InsertHandle<WriterPtr, HandleType::kAppend>(WriterPtr(new WriteFile));
+        }
+        return InsertHandle<WriterPtr, HandleType::kWrite>(WriterPtr(new WriteFile));
+    }
+
+    auto writer = client.WriteObject(bucketname, objectname);
+    if (!writer)
+    {
+        return nullptr;
+    }
+
+    WriterPtr writer_struct{new WriteFile};
+    writer_struct->bucketname_ = std::move(bucketname);
+    writer_struct->filename_ = std::move(objectname);
+    writer_struct->writer_ = std::move(writer);
+
+    if (appendMode)
+    {
+        return InsertHandle<WriterPtr, HandleType::kAppend>(std::move(writer_struct));
+    }
+    return InsertHandle<WriterPtr, HandleType::kWrite>(std::move(writer_struct));
+}
+*/
+const char *driver_getDriverName()
+{
+    return driver_name;
+}
+
+const char *driver_getVersion()
+{
+    return version;
+}
+
+const char *driver_getScheme()
+{
+    return driver_scheme;
+}
+
+int driver_isReadOnly()
+{
+    return kFalse;
+}
+
+int driver_connect()
+{
+    const std::string loglevel = GetEnvironmentVariableOrDefault("AZURE_DRIVER_LOGLEVEL", "info");
+    if (loglevel == "debug")
+        spdlog::set_level(spdlog::level::debug);
+    else if (loglevel == "trace")
+        spdlog::set_level(spdlog::level::trace);
+    else
+        spdlog::set_level(spdlog::level::info);
+
+    spdlog::debug("Connect {}", loglevel);
+
+    std::lock_guard<std::mutex> connection_lock(connectionMutex);
+
+    // Initialize variables from environment
+    globalBucketName = GetEnvironmentVariableOrDefault("AZURE_BUCKET_NAME", "");
+    streaming_read = GetEnvironmentVariableAsLongOrDefault("AZURE_DRIVER_STREAMING_READ", 0) != 0;
+    read_ahead_max_window = static_cast<size_t>(GetEnvironmentVariableAsLongOrDefault("AZURE_DRIVER_READ_AHEAD", 8));
+    read_ahead_max_chunk_size = std::max(1LL, GetEnvironmentVariableAsLongOrDefault("AZURE_DRIVER_READ_AHEAD_CHUNK_SIZE", 16 * 1024 * 1024));
+    read_ahead_max_bytes = GetEnvironmentVariableAsLongOrDefault("AZURE_DRIVER_READ_AHEAD_MAX_BYTES", 64 * 1024 * 1024);
+    background_pool.Configure(static_cast<size_t>(GetEnvironmentVariableAsLongOrDefault("AZURE_DRIVER_BACKGROUND_THREADS", 16)));
+    parallel_pool.Configure(static_cast<size_t>(GetEnvironmentVariableAsLongOrDefault("AZURE_DRIVER_PARALLEL_THREADS", 32)));
+    parallel_read_threshold = GetEnvironmentVariableAsLongOrDefault("AZURE_DRIVER_PARALLEL_READ_THRESHOLD", 16 * 1024 * 1024);
+    parallel_read_concurrency = static_cast<size_t>(GetEnvironmentVariableAsLongOrDefault("AZURE_DRIVER_PARALLEL_READ_CONCURRENCY", 8));
+    header_probe_concurrency = static_cast<size_t>(GetEnvironmentVariableAsLongOrDefault("AZURE_DRIVER_HEADER_PROBE_CONCURRENCY", 16));
+    cache_block_size = GetEnvironmentVariableAsLongOrDefault("AZURE_DRIVER_BLOCK_CACHE_BLOCK_SIZE", preferred_buffer_size);
+    if (cache_block_size <= 0)
+    {
+        cache_block_size = preferred_buffer_size;
+    }
+    block_cache.Configure(static_cast<size_t>(GetEnvironmentVariableAsLongOrDefault("AZURE_DRIVER_BLOCK_CACHE_SIZE", 256 * 1024 * 1024)));
+    disk_cache.Configure(GetEnvironmentVariableOrDefault("AZURE_DRIVER_DISK_CACHE_DIR", ""), cache_block_size,
+                         GetEnvironmentVariableAsLongOrDefault("AZURE_DRIVER_DISK_CACHE_SIZE", 10LL * 1024 * 1024 * 1024));
+    write_block_size = GetEnvironmentVariableAsLongOrDefault("AZURE_DRIVER_WRITE_BLOCK_SIZE", 8 * 1024 * 1024);
+    if (write_block_size <= 0 || write_block_size > max_block_size)
+    {
+        write_block_size = 8 * 1024 * 1024;
+    }
+    write_max_concurrency = static_cast<size_t>(GetEnvironmentVariableAsLongOrDefault("AZURE_DRIVER_WRITE_CONCURRENCY", 8));
+    delete_batch_concurrency = static_cast<size_t>(GetEnvironmentVariableAsLongOrDefault("AZURE_DRIVER_DELETE_BATCH_CONCURRENCY", 4));
+    blob_free_space = GetEnvironmentVariableAsLongOrDefault("AZURE_DRIVER_BLOB_FREE_SPACE", 5LL * 1024LL * 1024LL * 1024LL * 1024LL);
+    share_free_space.Configure(std::chrono::milliseconds(GetEnvironmentVariableAsLongOrDefault("AZURE_DRIVER_FREE_SPACE_TTL_MS", 10000)));
+    const std::chrono::milliseconds metadata_ttl{GetEnvironmentVariableAsLongOrDefault("AZURE_DRIVER_METADATA_CACHE_TTL_MS", 30000)};
+    metadata_cache.Configure(metadata_ttl);
+    tracer.Configure(GetEnvironmentVariableOrDefault("AZURE_DRIVER_TRACE_FILE", ""),
+                     static_cast<size_t>(GetEnvironmentVariableAsLongOrDefault("AZURE_DRIVER_TRACE_RING_SIZE", 65536)));
+    manifest_cache.Configure(metadata_ttl);
+    {
+        std::lock_guard<std::mutex> lock(made_directories_mutex);
+        made_directories.clear();
+    }
+
+    const std::string connectionString = GetConnectionStringOrDefault();
+
+    // Tester la connexion
+    try {
+        blobServiceClient.reset(new BlobServiceClient(BlobServiceClient::CreateFromConnectionString(connectionString, MakeClientOptions<BlobClientOptions>())));
+        auto properties = blobServiceClient->GetProperties();
+        std::cout << "Connexion valide." << std::endl;
+    } catch (const std::exception& e) {
+        std::cerr << "Erreur de connexion : " << e.what() << std::endl;
+        ReleaseServiceClients();
+        return kFailure;
+    }
+
+    // the file service is optional, e.g. the storage emulator only provides blobs
+    try {
+        shareServiceClient.reset(new ShareServiceClient(ShareServiceClient::CreateFromConnectionString(connectionString, MakeClientOptions<ShareClientOptions>())));
+    } catch (const std::exception& e) {
+        spdlog::debug("No file share service: {}", e.what());
+    }
+
+    bIsConnected = true;
+    return kSuccess;
+/*
+    gc::Options options{};
+
+    // Add project ID if defined
+    std::string project = GetEnvironmentVariableOrDefault("CLOUD_ML_PROJECT_ID", "");
+    if (!project.empty())
+    {
+        options.set<gc::UserProjectOption>(std::move(project));
+    }
+
+    std::string gcp_token_filename = GetEnvironmentVariableOrDefault("GCP_TOKEN", "");
+    if (!gcp_token_filename.empty())
+    {
+        // Initialize from token file
+        std::ifstream t(gcp_token_filename);
+        std::stringstream buffer;
+        buffer << t.rdbuf();
+        if (t.fail())
+        {
+            LogError("Error initializing token from file");
+            return kFailure;
+        }
+        std::shared_ptr<gc::Credentials> creds = gc::MakeServiceAccountCredentials(buffer.str());
         options.set<gc::UnifiedCredentialsOption>(std::move(creds));
     }
 
@@ -586,40 +3854,47 @@ int driver_connect()
 
 int driver_disconnect()
 {
-    /*
-    // loop on the still active handles to close as necessary and remove. clear() on the container would do it
+    std::lock_guard<std::mutex> connection_lock(connectionMutex);
+
+    // loop on the still active handles to close as necessary and remove. Dropping them would do it
     // but the procedures would fail silently.
-    std::vector<gc::Status> failures;
-    for (auto &h_ptr : active_handles)
+    std::vector<std::string> failures;
+    for (auto &h_ptr : active_handles.RemoveAll())
     {
-        // the writing streams need to be closed
+        // the writing streams need to be closed, once the calls in progress on them are done
+        std::lock_guard<std::mutex> lock(h_ptr->mutex);
         const HandleType type = h_ptr->type;
         if (HandleType::kRead != type)
         {
-            gc::Status status = CloseWriterStream(*h_ptr);
-            if (!status.ok())
+            try
+            {
+                CloseWriterStream(*h_ptr);
+            }
+            catch (const std::exception &e)
             {
-                failures.push_back(std::move(status));
+                failures.push_back(h_ptr->GetWriter().filename_ + ": " + e.what());
             }
         }
     }
-    active_handles.clear();
-*/
+
+    WaitForBackgroundTasks();
+    ReleaseServiceClients();
     bIsConnected = false;
+    DumpStats();
+    tracer.Write();
 
-    //if (failures.empty())
-    //{
+    if (failures.empty())
+    {
         return kSuccess;
-    //}
-/*
+    }
+
     std::ostringstream os;
     os << "Errors occured during disconnection:\n";
-    for (const auto &status : failures)
+    for (const auto &failure : failures)
     {
-        os << status << '\n';
+        os << failure << '\n';
     }
     LogError(os.str());
-    */
     return kFailure;
 }
 
@@ -635,6 +3910,8 @@ long long int driver_getSystemPreferredBufferSize()
 
 int driver_exist(const char *filename)
 {
+    OpTimer timer(DriverOp::kExist);
+
     ERROR_ON_NULL_ARG(filename, "Error passing null pointer to exist", kFalse);
 
     spdlog::debug("exist {}", filename);
@@ -654,48 +3931,45 @@ int driver_exist(const char *filename)
 }
 
 
-#define RETURN_ON_ERROR(status_or, msg, err_val)
- /*                       \
-{                                                                       \
-    if (!(status_or))                                                   \
-    {                                                                   \
-        LogBadStatus((status_or).status(), (msg));                      \
-        return (err_val);                                               \
-    }                                                                   \
-}                                                                       \
-*/
-
-#define ERROR_ON_NAMES(status_or_names, err_val) RETURN_ON_ERROR((status_or_names), "Error parsing URL", (err_val))
+// ParseAzureUri only attaches a raw response to its result when the parsing failed
+#define ERROR_ON_NAMES(maybe_names, err_val)                                    \
+if ((maybe_names).RawResponse)                                                  \
+{                                                                               \
+    LogError("Error parsing URL: " + (maybe_names).RawResponse->GetReasonPhrase()); \
+    return (err_val);                                                           \
+}                                                                               \
 
 
 int driver_fileExists(const char *sFilePathName)
 {
+    OpTimer timer(DriverOp::kFileExists);
+
     ERROR_ON_NULL_ARG(sFilePathName, "Error passing null pointer to fileExists.", kFalse);
 
     spdlog::debug("fileExist {}", sFilePathName);
 
     auto maybe_parsed_names = GetServiceBucketAndObjectNames(sFilePathName);
-/*
     ERROR_ON_NAMES(maybe_parsed_names, kFalse);
-*/
+
     try {
-        if (maybe_parsed_names.Value.service == SHARE) {
-            GetShareServiceClient().GetShareClient(maybe_parsed_names.Value.bucket)
-                    .GetRootDirectoryClient().GetFileClient(maybe_parsed_names.Value.object)
-                    .GetProperties();
-        } else {
-            GetBlobServiceClient().GetBlobContainerClient(maybe_parsed_names.Value.bucket)
-                    .GetBlockBlobClient(maybe_parsed_names.Value.object)
-                    .GetProperties();
+        const auto &names = maybe_parsed_names.Value;
+        if (SHARE != names.service && IsGlobPattern(names.object)) {
+            ListObjects(names.bucket, names.object);
+        } else if (!GetObjectMetadata(names).exists) {
+            return kFalse; // Le blob n'existe pas
         }
         spdlog::debug("file {} exists!", sFilePathName);
         return kTrue;
 
     } catch (const Azure::Core::RequestFailedException& e) {
         if (e.StatusCode == Azure::Core::Http::HttpStatusCode::NotFound) {
-            return kFalse; // Le blob n'existe pas
+            return kFalse; // aucun blob ne correspond
         }
-        throw; // Relancer l'exception pour d'autres erreurs
+        LogBadStatus(e, "Error checking if file exists");
+        return kFalse;
+    } catch (const std::exception& e) {
+        LogBadStatus(e, "Error checking if file exists");
+        return kFalse;
     }
 
 /*
@@ -711,273 +3985,290 @@ int driver_fileExists(const char *sFilePathName)
 
 int driver_dirExists(const char *sFilePathName)
 {
+    OpTimer timer(DriverOp::kDirExists);
+
     ERROR_ON_NULL_ARG(sFilePathName, "Error passing null pointer to dirExists", kFalse);
 
     spdlog::debug("dirExist {}", sFilePathName);
-    return kTrue;
-}
-/*
-gc::StatusOr<std::string> ReadHeader(const std::string &bucket_name, const std::string &filename)
-{
-    gcs::ObjectReadStream stream = client.ReadObject(bucket_name, filename);
-    std::string line;
-    std::getline(stream, line, '\n');
-    if (stream.bad())
-    {
-        return stream.status();
-    }
-    if (!stream.eof())
+
+    auto maybe_parsed_names = GetServiceBucketAndObjectNames(sFilePathName);
+    ERROR_ON_NAMES(maybe_parsed_names, kFalse);
+
+    try
     {
-        line.push_back('\n');
+        return DirectoryExists(maybe_parsed_names.Value) ? kTrue : kFalse;
     }
-    if (line.empty())
+    catch (const std::exception &e)
     {
-        return gc::Status{gc::StatusCode::kInternal, "Got an empty header"};
+        LogBadStatus(e, "Error checking if directory exists");
+        return kFalse;
     }
-    return line;
 }
-*/
+
+Manifest ResolveManifest(const std::string &bucketname, const std::string &objectname);
 
 long long int driver_getFileSize(const char *filename)
 {
+    OpTimer timer(DriverOp::kGetFileSize);
+
     ERROR_ON_NULL_ARG(filename, "Error passing null pointer to getFileSize.", -1);
 
     spdlog::debug("getFileSize {}", filename);
 
     auto maybe_parsed_names = GetServiceBucketAndObjectNames(filename);
 
-    ERROR_ON_NAMES(maybe_names, -1);
+    ERROR_ON_NAMES(maybe_parsed_names, -1);
 
     try {
-        if (maybe_parsed_names.Value.service == SHARE) {
-            auto props = GetShareServiceClient().GetShareClient(maybe_parsed_names.Value.bucket)
-                    .GetRootDirectoryClient().GetFileClient(maybe_parsed_names.Value.object)
-                    .GetProperties();
-            return props.Value.FileSize;
-        } else {
-            auto props = GetBlobServiceClient().GetBlobContainerClient(maybe_parsed_names.Value.bucket)
-                    .GetBlockBlobClient(maybe_parsed_names.Value.object)
-                    .GetProperties();
-            return props.Value.BlobSize;
+        const auto &names = maybe_parsed_names.Value;
+        if (SHARE != names.service && IsGlobPattern(names.object)) {
+            // the size of a multi-part file does not count the repeated headers
+            return ResolveManifest(names.bucket, names.object).total_size;
+        }
+        const ObjectMetadata metadata = GetObjectMetadata(names);
+        if (!metadata.exists) {
+            LogError(std::string("File not found: ") + filename);
+            return -1; // Le blob n'existe pas
         }
+        return metadata.size;
     } catch (const Azure::Core::RequestFailedException& e) {
         if (e.StatusCode == Azure::Core::Http::HttpStatusCode::NotFound) {
-            LogError(e.ReasonPhrase);
-            return -1; // Le blob n'existe pas
+            LogError(std::string("File not found: ") + filename);
+            return -1; // aucun blob ne correspond
         }
-        throw; // Relancer l'exception pour d'autres erreurs
+        LogBadStatus(e, "Error getting file size");
+        return -1;
+    } catch (const std::exception& e) {
+        LogBadStatus(e, "Error getting file size");
+        return -1;
     }
 }
-/*
-gc::StatusOr<ReaderPtr> MakeReaderPtr(std::string bucketname, std::string objectname)
+
+// Lists the parts of a file and finds out whether they share a header.
+// The manifest of a glob pattern is cached, and reused as long as its parts are unchanged.
+Manifest ResolveManifest(const std::string &bucketname, const std::string &objectname)
 {
-    std::vector<std::string> filenames;
-    std::vector<long long> cumulativeSize;
+    const bool is_pattern = IsGlobPattern(objectname);
 
-    auto push_back_data = [&](gcs::ListObjectsIterator &list_it)
+    Manifest manifest;
+    if (is_pattern && manifest_cache.Get(bucketname, objectname, manifest))
     {
-        filenames.push_back((*list_it)->name());
-        long long size = static_cast<long long>((*list_it)->size());
-        if (!cumulativeSize.empty())
-        {
-            size += cumulativeSize.back();
-        }
-        cumulativeSize.push_back(size);
-    };
-
-    auto maybe_list = ListObjects(bucketname, objectname);
-    RETURN_STATUS_ON_ERROR(maybe_list);
-
-    auto list_it = maybe_list->begin();
-    const auto list_end = maybe_list->end();
-
-    push_back_data(list_it);
+        CountStat(stats.manifest_cache_hits);
+        return manifest;
+    }
 
-    list_it++;
-    if (list_end == list_it)
+    const auto list = ListObjects(bucketname, objectname);
+    if (is_pattern && manifest_cache.GetIfUnchanged(bucketname, objectname, list, manifest))
     {
-        // unique file
-        const tOffset total_size = cumulativeSize.back();
-        return ReaderPtr(new MultiPartFile{
-            std::move(bucketname),
-            std::move(objectname),
-            0,
-            0,
-            std::move(filenames),
-            std::move(cumulativeSize),
-            total_size});
+        CountStat(stats.manifest_cache_hits);
+        return manifest;
+    }
+    if (is_pattern)
+    {
+        CountStat(stats.manifest_cache_misses);
     }
 
-    // multifile
-    // check headers
-    auto maybe_header = ReadHeader(bucketname, filenames.front());
-    RETURN_STATUS_ON_ERROR(maybe_header);
-
-    const std::string& header = *maybe_header;
-    const long long header_size = static_cast<long long>(header.size());
-    bool same_header{true};
-
-    for (; list_it != list_end; list_it++)
+    std::vector<std::string> filenames;
+    std::vector<long long> sizes;
+    std::vector<std::string> etags;
+    for (const auto &info : list)
     {
-        RETURN_STATUS_ON_ERROR(*list_it);
+        filenames.push_back(info.name);
+        sizes.push_back(info.size);
+        etags.push_back(info.etag);
+    }
 
-        push_back_data(list_it);
+    // multifile: the header of the first part is dropped from the others if they all share it
+    std::string header;
+    bool same_header{false};
+    if (list.size() > 1)
+    {
+        header = ReadHeader(bucketname, filenames.front(), etags.front(), static_cast<tOffset>(sizes.front()));
+        same_header = !header.empty() && OtherPartsShareHeader(bucketname, filenames, etags, sizes, header);
+    }
+    manifest.header_length = same_header ? static_cast<tOffset>(header.size()) : 0;
 
-        if (same_header)
-        {
-            auto maybe_curr_header = ReadHeader(bucketname, filenames.back());
-            RETURN_STATUS_ON_ERROR(maybe_curr_header);
+    std::vector<long long> cumulative_sizes;
+    cumulative_sizes.reserve(sizes.size());
+    for (size_t i = 0; i < sizes.size(); i++)
+    {
+        manifest.total_size += sizes[i] - (i > 0 ? manifest.header_length : 0);
+        cumulative_sizes.push_back(manifest.total_size);
+    }
+    manifest.parts = std::make_shared<const PartManifest>(filenames, cumulative_sizes, etags);
 
-            same_header = (header == *maybe_curr_header);
-            if (same_header)
-            {
-                cumulativeSize.back() -= header_size;
-            }
-        }
+    if (is_pattern)
+    {
+        manifest_cache.Put(bucketname, objectname, manifest);
     }
+    return manifest;
+}
 
-    tOffset total_size = cumulativeSize.back();
+// A file of a share is always a single part, with fresh properties as for a single blob
+Manifest ResolveShareFileManifest(const std::string &share_name, const std::string &path)
+{
+    RejectSharePattern(path);
+    const ObjectMetadata metadata = ToObjectMetadata(GetShareFileClient(share_name, path).GetProperties().Value);
+    metadata_cache.Put(SHARE, share_name, path, metadata);
+
+    Manifest manifest;
+    manifest.total_size = metadata.size;
+    manifest.parts = std::make_shared<const PartManifest>(std::vector<std::string>{path}, std::vector<long long>{metadata.size}, std::vector<std::string>{metadata.etag});
+    return manifest;
+}
 
+ReaderPtr MakeReaderPtr(std::string bucketname, std::string objectname, Service service)
+{
+    Manifest manifest = SHARE == service ? ResolveShareFileManifest(bucketname, objectname) : ResolveManifest(bucketname, objectname);
+    auto clients = MakePartClients(bucketname, *manifest.parts, service);
     return ReaderPtr(new MultiPartFile{
         std::move(bucketname),
         std::move(objectname),
         0,
-        same_header ? header_size : 0,
-        std::move(filenames),
-        std::move(cumulativeSize),
-        total_size});
+        manifest.header_length,
+        std::move(manifest.parts),
+        manifest.total_size,
+        nullptr,
+        nullptr,
+        SHARE == service ? SHARE : BLOB,
+        std::move(clients)});
+}
+
+template <typename StreamPtr, HandleType Type>
+void *RegisterStream(std::function<StreamPtr(std::string, std::string)> MakeStreamPtr, std::string &&bucket, std::string &&object)
+{
+    return InsertHandle<StreamPtr, Type>(MakeStreamPtr(std::move(bucket), std::move(object)));
 }
 
-gc::StatusOr<WriterPtr> MakeWriterPtr(std::string bucketname, std::string objectname)
+void *RegisterReader(std::string &&bucket, std::string &&object, Service service)
+{
+    return RegisterStream<ReaderPtr, HandleType::kRead>([service](std::string bucketname, std::string objectname)
+                                                        { return MakeReaderPtr(std::move(bucketname), std::move(objectname), service); },
+                                                        std::move(bucket), std::move(object));
+}
+WriterPtr MakeWriterPtr(std::string bucketname, std::string objectname)
 {
-    auto writer = client.WriteObject(bucketname, objectname);
-    if (!writer)
-    {
-        return writer.last_status();
-    }
     WriterPtr writer_struct{new WriteFile};
+    writer_struct->upload_ = MakeBlockUpload(GetBlockBlobClient(bucketname, objectname), static_cast<size_t>(write_block_size));
     writer_struct->bucketname_ = std::move(bucketname);
     writer_struct->filename_ = std::move(objectname);
-    writer_struct->writer_ = std::move(writer);
     return writer_struct;
 }
 
-template <typename StreamPtr, HandleType Type>
-gc::StatusOr<Handle *> RegisterStream(std::function<gc::StatusOr<StreamPtr>(std::string, std::string)> MakeStreamPtr, std::string &&bucket, std::string &&object)
+WriterPtr MakeAppenderPtr(std::string bucketname, std::string objectname)
+{
+    WriterPtr writer_struct = MakeWriterPtr(bucketname, objectname);
+    PrepareAppend(*writer_struct->upload_, bucketname, objectname);
+    return writer_struct;
+}
+
+// The file is created empty, or truncated
+WriterPtr MakeShareWriterPtr(std::string share_name, std::string path)
 {
-    auto maybe_stream = MakeStreamPtr(std::move(bucket), std::move(object));
-    RETURN_STATUS_ON_ERROR(maybe_stream);
+    ShareFileClient client = GetShareFileClient(share_name, path);
+    const tOffset previous_size = GetShareFileSizeOrZero(client);
+    client.Create(0);
+    // the written ranges are charged as they are uploaded, the truncated content gives its space back
+    share_free_space.Consume(share_name, -previous_size);
 
-    return InsertHandle<StreamPtr, Type>(std::move(maybe_stream).value());
+    WriterPtr writer_struct{new WriteFile};
+    writer_struct->range_upload_ = MakeRangeUpload(std::move(client), share_name, 0, 0);
+    writer_struct->bucketname_ = std::move(share_name);
+    writer_struct->filename_ = std::move(path);
+    return writer_struct;
 }
 
-gc::StatusOr<Handle *> RegisterReader(std::string &&bucket, std::string &&object)
+// The writes go on at the end of the file, created if missing
+WriterPtr MakeShareAppenderPtr(std::string share_name, std::string path)
 {
-    return RegisterStream<ReaderPtr, HandleType::kRead>(MakeReaderPtr, std::move(bucket), std::move(object));
+    ShareFileClient client = GetShareFileClient(share_name, path);
+    tOffset file_size{0};
+    try
+    {
+        file_size = static_cast<tOffset>(client.GetProperties().Value.FileSize);
+    }
+    catch (const Azure::Core::RequestFailedException &e)
+    {
+        if (e.StatusCode != Azure::Core::Http::HttpStatusCode::NotFound)
+        {
+            throw;
+        }
+        client.Create(0);
+    }
+
+    WriterPtr writer_struct{new WriteFile};
+    writer_struct->range_upload_ = MakeRangeUpload(std::move(client), share_name, file_size, file_size);
+    writer_struct->bucketname_ = std::move(share_name);
+    writer_struct->filename_ = std::move(path);
+    return writer_struct;
 }
 
-gc::StatusOr<Handle *> RegisterWriter(std::string &&bucket, std::string &&object)
+void *RegisterWriter(std::string &&bucket, std::string &&object, Service service)
 {
-    return RegisterStream<WriterPtr, HandleType::kWrite>(MakeWriterPtr, std::move(bucket), std::move(object));
+    return RegisterStream<WriterPtr, HandleType::kWrite>(SHARE == service ? MakeShareWriterPtr : MakeWriterPtr, std::move(bucket), std::move(object));
 }
 
-gc::StatusOr<Handle *> RegisterWriterForAppend(std::string &&bucket, std::string &&tmp, std::string append_target)
+void *RegisterWriterForAppend(std::string &&bucket, std::string &&object, Service service)
 {
-    auto maybe_handle = RegisterStream<WriterPtr, HandleType::kAppend>(MakeWriterPtr, std::move(bucket), std::move(tmp));
-    if (maybe_handle)
-    {
-        (*maybe_handle)->GetWriter().append_target_ = std::move(append_target);
-    }
-    return maybe_handle;
+    return RegisterStream<WriterPtr, HandleType::kAppend>(SHARE == service ? MakeShareAppenderPtr : MakeAppenderPtr, std::move(bucket), std::move(object));
 }
-*/
+
 void *driver_fopen(const char *filename, char mode)
 {
+    OpTimer timer(DriverOp::kFopen);
+
     assert(driver_isConnected());
 
     ERROR_ON_NULL_ARG(filename, "Error passing null pointer to fopen.", nullptr);
 
     spdlog::debug("fopen {} {}", filename, mode);
 
-    // auto maybe_names = GetBucketAndObjectNames(filename);
-    // ERROR_ON_NAMES(maybe_names, nullptr);
+    auto maybe_names = GetServiceBucketAndObjectNames(filename);
+    ERROR_ON_NAMES(maybe_names, nullptr);
 
-    // auto& names = *maybe_names;
+    auto &names = maybe_names.Value;
 
-    // gc::StatusOr<Handle *> maybe_handle;
+    void *handle{nullptr};
     std::string err_msg;
-/*
-    switch (mode)
-    {
-    case 'r':
-    {
-        maybe_handle = RegisterReader(std::move(names.bucket), std::move(names.object));
-        err_msg = "Error while opening reader stream";
-        break;
-    }
-    case 'w':
-    {
-        maybe_handle = RegisterWriter(std::move(names.bucket), std::move(names.object));
-        err_msg = "Error while opening writer stream";
-        break;
-    }
-    case 'a':
-    {
-        // GCS does not as yet provide a way to add data to existing files.
-        // This will be the process to emulate an append:
-        // - check existence of the target object
-        // - open a temporary write object to upload the new data
-        // - compose, as defined by GCS, the source with the new temporary object
-        //
-        // The actual composition will happen on closing of the append stream
 
-        auto maybe_list = ListObjects(names.bucket, names.object);
-        if (!maybe_list)
+    try
+    {
+        switch (mode)
         {
-            // If file doesn't exist, fallback to write mode
-            maybe_handle = RegisterWriter(std::move(names.bucket), std::move(names.object));
-            err_msg = "Error while opening writer stream";
+        case 'r':
+        {
+            err_msg = "Error while opening reader stream";
+            handle = RegisterReader(std::move(names.bucket), std::move(names.object), names.service);
             break;
         }
-
-        // go to end of list to get the target file name
-        auto list_it = maybe_list->begin();
-        const auto list_end = maybe_list->end();
-        auto to_last_item = list_it;
-        list_it++;
-        while (list_end != list_it)
+        case 'w':
         {
-            to_last_item = list_it;
-            list_it++;
+            err_msg = "Error while opening writer stream";
+            handle = RegisterWriter(std::move(names.bucket), GetWrittenObjectName(names), names.service);
+            break;
         }
-
-        if (!to_last_item->ok())
+        case 'a':
         {
-            // data is unusable
-            maybe_handle = std::move(*to_last_item).status();
-            err_msg = "Error opening file in append mode";
+            err_msg = "Error while opening append stream";
+            handle = RegisterWriterForAppend(std::move(names.bucket), GetWrittenObjectName(names), names.service);
             break;
         }
-
-        // get a writer handle
-        maybe_handle = RegisterWriterForAppend(std::move(names.bucket), "tmp_object_to_append", to_last_item->value().name());
-        err_msg = "Error opening file in append mode, cannot open tmp object";
-        break;
+        default:
+            LogError(std::string("Invalid open mode: ") + mode);
+            return nullptr;
+        }
     }
-    default:
-        LogError("Invalid open mode: " + mode);
+    catch (const std::exception &e)
+    {
+        LogBadStatus(e, err_msg);
         return nullptr;
     }
 
-    RETURN_ON_ERROR(maybe_handle, err_msg, nullptr);
-
-    return *maybe_handle;
-    */
-   return NULL;
+    return handle;
 }
 
-#define ERROR_NO_STREAM(handle_it, errval)       \
-if ((handle_it) == active_handles.end())         \
+#define ERROR_NO_STREAM(handle_ptr, errval)      \
+if (!(handle_ptr))                               \
 {                                                \
     LogError("Cannot identify stream");          \
     return (errval);                             \
@@ -985,45 +4276,50 @@ if ((handle_it) == active_handles.end())         \
 
 int driver_fclose(void *stream)
 {
+    OpTimer timer(DriverOp::kFclose);
+    TraceHandleScope trace_scope(stream);
+
     assert(driver_isConnected());
 
     ERROR_ON_NULL_ARG(stream, "Error passing null pointer to fclose", kCloseEOF);
 
     spdlog::debug("fclose {}", (void *)stream);
 
-    auto stream_it = FindHandle(stream);
-    ERROR_NO_STREAM(stream_it, kCloseEOF);
-    auto &h_ptr = *stream_it;
-/*
-    gc::Status status;
+    // no other call can find the handle from now on, wait for those in progress
+    HandlePtr h_ptr = active_handles.Remove(stream);
+    ERROR_NO_STREAM(h_ptr, kCloseEOF);
+    std::lock_guard<std::mutex> lock(h_ptr->mutex);
+
+    bool closed{true};
 
     if (HandleType::kRead != h_ptr->type)
     {
-        status = CloseWriterStream(*h_ptr);
+        try
+        {
+            CloseWriterStream(*h_ptr);
+        }
+        catch (const std::exception &e)
+        {
+            LogBadStatus(e, "Error while closing writer stream");
+            closed = false;
+        }
     }
 
-    EraseRemove(stream_it);
-
-    if (!status.ok())
-    {
-        LogBadStatus(status, "Error while closing writer stream");
-        return kFailure;
-    }
-*/
-    return kCloseSuccess;
+    return closed ? kCloseSuccess : kCloseEOF;
 }
 
 int driver_fseek(void *stream, long long int offset, int whence)
 {
+    OpTimer timer(DriverOp::kFseek);
+
     constexpr long long max_val = std::numeric_limits<long long>::max();
 
     ERROR_ON_NULL_ARG(stream, "Error passing null pointer to fseek", -1);
 
     // confirm stream's presence
-    auto to_stream = FindHandle(stream);
-    ERROR_NO_STREAM(to_stream, -1);
-
-    auto &stream_h = *to_stream;
+    HandlePtr stream_h = FindHandle(stream);
+    ERROR_NO_STREAM(stream_h, -1);
+    std::lock_guard<std::mutex> lock(stream_h->mutex);
 
     if (HandleType::kRead != stream_h->type)
     {
@@ -1082,6 +4378,13 @@ int driver_fseek(void *stream, long long int offset, int whence)
     return 0;
 }
 
+const char *driver_getStats()
+{
+    // only reads the counters, the calls in progress are not waited for
+    lastStats = StatsToJson();
+    return lastStats.c_str();
+}
+
 const char *driver_getlasterror()
 {
     spdlog::debug("getlasterror");
@@ -1095,6 +4398,9 @@ const char *driver_getlasterror()
 
 long long int driver_fread(void *ptr, size_t size, size_t count, void *stream)
 {
+    OpTimer timer(DriverOp::kFread);
+    TraceHandleScope trace_scope(stream);
+
     ERROR_ON_NULL_ARG(stream, "Error passing null stream pointer to fread", -1);
     ERROR_ON_NULL_ARG(ptr, "Error passing null buffer pointer to fread", -1);
 
@@ -1105,14 +4411,9 @@ long long int driver_fread(void *ptr, size_t size, size_t count, void *stream)
     }
 
     // confirm stream's presence
-    auto to_stream = FindHandle(stream);
-    if (to_stream == active_handles.end())
-    {
-        LogError("Cannot identify stream");
-        return -1;
-    }
-
-    auto &stream_h = *to_stream;
+    HandlePtr stream_h = FindHandle(stream);
+    ERROR_NO_STREAM(stream_h, -1);
+    std::lock_guard<std::mutex> lock(stream_h->mutex);
 
     if (HandleType::kRead != stream_h->type)
     {
@@ -1166,17 +4467,25 @@ long long int driver_fread(void *ptr, size_t size, size_t count, void *stream)
     {
         spdlog::debug("offset = {} to_read = {}", offset, to_read);
     }
-/*
-    auto maybe_read = ReadBytesInFile(h, reinterpret_cast<char *>(ptr), to_read);
-    RETURN_ON_ERROR(maybe_read, "Error while reading from file", -1);
 
-    return *maybe_read;
-    */
-   return 0;
+    try
+    {
+        const long long num_read = ReadBytesInFile(h, reinterpret_cast<char *>(ptr), to_read);
+        CountStat(stats.bytes_read, static_cast<uint64_t>(num_read));
+        return num_read;
+    }
+    catch (const std::exception &e)
+    {
+        LogBadStatus(e, "Error while reading from file");
+        return -1;
+    }
 }
 
 long long int driver_fwrite(const void *ptr, size_t size, size_t count, void *stream)
 {
+    OpTimer timer(DriverOp::kFwrite);
+    TraceHandleScope trace_scope(stream);
+
     ERROR_ON_NULL_ARG(stream, "Error passing null stream pointer to fwrite", -1);
     ERROR_ON_NULL_ARG(ptr, "Error passing null buffer pointer to fwrite", -1);
 
@@ -1188,138 +4497,588 @@ long long int driver_fwrite(const void *ptr, size_t size, size_t count, void *st
 
     spdlog::debug("fwrite {} {} {} {}", ptr, size, count, stream);
 
-    auto stream_it = FindHandle(stream);
-    ERROR_NO_STREAM(stream_it, -1);
-    Handle &stream_h = **stream_it;
+    HandlePtr stream_ptr = FindHandle(stream);
+    ERROR_NO_STREAM(stream_ptr, -1);
+    std::lock_guard<std::mutex> lock(stream_ptr->mutex);
+    Handle &stream_h = *stream_ptr;
+
+    const HandleType type = stream_h.type;
+
+    if (HandleType::kRead == type)
+    {
+        LogError("Cannot write on not writing stream");
+        return -1;
+    }
+
+    // fast exit for 0
+    if (0 == count)
+    {
+        return 0;
+    }
+
+    // prevent integer overflow
+    if (WillSizeCountProductOverflow(size, count))
+    {
+        LogError("Error on write: product size * count is too large, would overflow");
+        return -1;
+    }
+
+    const long long to_write = static_cast<long long>(size * count);
+
+    try
+    {
+        const WriteFile &writer = stream_h.GetWriter();
+        if (writer.range_upload_)
+        {
+            WriteToRangeUpload(*writer.range_upload_, static_cast<const char *>(ptr), static_cast<size_t>(to_write));
+        }
+        else
+        {
+            WriteToUpload(*writer.upload_, static_cast<const char *>(ptr), static_cast<size_t>(to_write));
+        }
+    }
+    catch (const std::exception &e)
+    {
+        LogBadStatus(e, "Error during upload");
+        return -1;
+    }
+
+    CountStat(stats.bytes_written, static_cast<uint64_t>(to_write));
+    return to_write;
+}
+
+int driver_fflush(void *stream)
+{
+    OpTimer timer(DriverOp::kFflush);
+    TraceHandleScope trace_scope(stream);
+
+    ERROR_ON_NULL_ARG(stream, "Error passing null stream pointer to fflush", -1);
+
+    HandlePtr stream_ptr = FindHandle(stream);
+    ERROR_NO_STREAM(stream_ptr, -1);
+    std::lock_guard<std::mutex> lock(stream_ptr->mutex);
+    Handle &stream_h = *stream_ptr;
+
+    if (HandleType::kRead == stream_h.type)
+    {
+        LogError("Cannot flush on not writing stream");
+        return -1;
+    }
+
+    // the content of a blob only changes when the block list is committed on close, so flushing only
+    // waits for the blocks in flight, to report their errors. The partial block is kept buffered.
+    // A file of a share is written in place: all that was written is there once flushed.
+    try
+    {
+        const WriteFile &writer = stream_h.GetWriter();
+        if (writer.range_upload_)
+        {
+            FlushRangeUpload(*writer.range_upload_);
+            InvalidateCachedObject(writer.bucketname_, writer.filename_);
+        }
+        else
+        {
+            BlockUpload &upload = *writer.upload_;
+            CheckUploadNotFailed(upload);
+            WaitForStagedBlocks(upload, 0);
+        }
+    }
+    catch (const std::exception &e)
+    {
+        LogBadStatus(e, "Error during upload");
+        return -1;
+    }
+
+    return 0;
+}
+
+// Deletes blobs with a single batch request. Returns the failures, a blob already gone is not one.
+std::vector<std::string> DeleteBlobBatch(const std::string &bucket_name, const std::vector<std::string> &blob_names)
+{
+    auto client = GetContainerClient(bucket_name);
+    auto batch = client.CreateBatch();
+    std::vector<Azure::Storage::DeferredResponse<Blobs::Models::DeleteBlobResult>> responses;
+    responses.reserve(blob_names.size());
+    for (const auto &name : blob_names)
+    {
+        responses.push_back(batch.DeleteBlob(name));
+    }
+
+    std::vector<std::string> failures;
+    try
+    {
+        client.SubmitBatch(batch);
+    }
+    catch (const std::exception &e)
+    {
+        failures.push_back("batch of " + std::to_string(blob_names.size()) + " deletions from " + blob_names.front() + ": " + e.what());
+        responses.clear();
+    }
+
+    for (size_t i = 0; i < responses.size(); i++)
+    {
+        try
+        {
+            responses[i].GetResponse();
+        }
+        catch (const Azure::Core::RequestFailedException &e)
+        {
+            if (e.StatusCode != Azure::Core::Http::HttpStatusCode::NotFound)
+            {
+                failures.push_back(blob_names[i] + ": " + e.what());
+            }
+        }
+    }
+
+    // whatever the outcome, what is cached may no longer reflect the blobs
+    for (const auto &name : blob_names)
+    {
+        InvalidateCachedObject(bucket_name, name);
+    }
+    return failures;
+}
+
+// Deletes the blobs whose name starts with prefix and, unless pattern is empty, matches the glob pattern.
+// The paged listing feeds batches of up to max_delete_batch_size deletions, up to delete_batch_concurrency
+// of them in flight. The failures of all the batches are gathered in a single exception.
+void DeleteBlobs(const std::string &bucket_name, const std::string &prefix, const std::string &pattern)
+{
+    std::deque<std::future<std::vector<std::string>>> pending;
+    std::vector<std::string> failures;
+    size_t blob_count{0};
+
+    auto wait_first = [&pending, &failures]()
+    {
+        for (auto &failure : pending.front().get())
+        {
+            failures.push_back(std::move(failure));
+        }
+        pending.pop_front();
+    };
+
+    auto submit = [&](std::vector<std::string> &&names)
+    {
+        while (!pending.empty() && pending.size() >= delete_batch_concurrency)
+        {
+            wait_first();
+        }
+        auto batch = std::make_shared<std::vector<std::string>>(std::move(names));
+        pending.push_back(LaunchInPool<std::vector<std::string>>(parallel_pool, [bucket_name, batch]()
+                                                                 { return DeleteBlobBatch(bucket_name, *batch); }));
+    };
+
+    ListBlobsOptions options;
+    options.Prefix = prefix;
+
+    std::vector<std::string> names;
+    for (auto page = GetContainerClient(bucket_name).ListBlobs(options); page.HasPage(); page.MoveToNextPage())
+    {
+        for (const auto &blob : page.Blobs)
+        {
+            if (!pattern.empty() && !GlobMatch(pattern, blob.Name))
+            {
+                continue;
+            }
+            names.push_back(blob.Name);
+            blob_count++;
+            if (names.size() == max_delete_batch_size)
+            {
+                submit(std::move(names));
+                names.clear();
+            }
+        }
+    }
+    if (!names.empty())
+    {
+        submit(std::move(names));
+    }
+    while (!pending.empty())
+    {
+        wait_first();
+    }
+
+    spdlog::debug("Deleted {} blobs under {} with {} failures", blob_count, prefix, failures.size());
+
+    if (!failures.empty())
+    {
+        constexpr size_t max_reported{10};
+        std::ostringstream os;
+        os << "Failed to delete " << failures.size() << " of " << blob_count << " blobs";
+        for (size_t i = 0; i < failures.size() && i < max_reported; i++)
+        {
+            os << (i == 0 ? ": " : "; ") << failures[i];
+        }
+        if (failures.size() > max_reported)
+        {
+            os << "; ...";
+        }
+        throw std::runtime_error(os.str());
+    }
+}
+
+int driver_remove(const char *filename)
+{
+    OpTimer timer(DriverOp::kRemove);
+
+    ERROR_ON_NULL_ARG(filename, "Error passing null pointer to remove", kFailure);
+
+    spdlog::debug("remove {}", filename);
+
+    assert(driver_isConnected());
+
+    auto maybe_names = GetServiceBucketAndObjectNames(filename);
+    ERROR_ON_NAMES(maybe_names, kFailure);
+
+    std::string blobName = maybe_names.Value.object;
+    spdlog::debug("Deleting blob: {}", blobName);
+    std::string containerName = maybe_names.Value.bucket;
+
+    bool has_wildcards;
+    const std::string prefix = GetGlobLiteralPrefix(blobName, has_wildcards);
+    if (has_wildcards && SHARE == maybe_names.Value.service)
+    {
+        LogError("Error deleting object: glob patterns are not supported on file shares: " + blobName);
+        return kFailure;
+    }
+    if (has_wildcards)
+    {
+        // all the matching blobs are deleted
+        try
+        {
+            DeleteBlobs(containerName, prefix, blobName);
+        }
+        catch (const std::exception &e)
+        {
+            LogBadStatus(e, "Error deleting objects");
+            return kFailure;
+        }
+        return kSuccess;
+    }
+
+    // escaped wildcards name a blob literally, as for the reads
+    const std::string object_name = SHARE == maybe_names.Value.service ? blobName : prefix;
+
+    int result{kSuccess};
+    try
+    {
+        if (SHARE == maybe_names.Value.service)
+        {
+            const ShareFileClient client = GetShareFileClient(containerName, object_name);
+            const tOffset size = GetShareFileSizeOrZero(client);
+            client.Delete();
+            share_free_space.Consume(containerName, -size);
+        }
+        else
+        {
+            // Create the block blob client
+            BlockBlobClient blobClient = GetBlockBlobClient(containerName, object_name);
+            blobClient.Delete();
+        }
+    }
+    catch (const Azure::Core::RequestFailedException &e)
+    {
+        if (e.StatusCode != Azure::Core::Http::HttpStatusCode::NotFound)
+        {
+            LogBadStatus(e, "Error deleting object");
+            result = kFailure;
+        }
+    }
+    catch (const std::exception &e)
+    {
+        LogBadStatus(e, "Error deleting object");
+        result = kFailure;
+    }
+
+    // whatever the outcome, what is cached may no longer reflect the blob
+    InvalidateCachedObject(containerName, object_name);
+
+    return result;
+}
+
+int driver_rmdir(const char *filename)
+{
+    OpTimer timer(DriverOp::kRmdir);
+
+    ERROR_ON_NULL_ARG(filename, "Error passing null pointer to rmdir", kFailure);
+
+    spdlog::debug("rmdir {}", filename);
+
+    assert(driver_isConnected());
 
-    const HandleType type = stream_h.type;
+    auto maybe_names = GetServiceBucketAndObjectNames(filename);
+    ERROR_ON_NAMES(maybe_names, kFailure);
 
-    if (HandleType::kRead == type)
+    const auto &names = maybe_names.Value;
+    std::string path = names.object;
+    if (!path.empty() && path.back() != '/')
     {
-        LogError("Cannot write on not writing stream");
-        return -1;
+        path.push_back('/');
+    }
+    if (path.empty())
+    {
+        LogError("Error removing directory: refusing to remove the whole container " + names.bucket);
+        return kFailure;
     }
 
-    // fast exit for 0
-    if (0 == count)
+    if (SHARE == names.service)
     {
-        return 0;
+        // a directory of a share is removed only if empty, as a local one
+        int result{kSuccess};
+        try
+        {
+            GetShareServiceClient().GetShareClient(names.bucket).GetRootDirectoryClient().GetSubdirectoryClient(path.substr(0, path.size() - 1)).Delete();
+            // the directory held nothing, but its own metadata no longer uses the share
+            share_free_space.Invalidate(names.bucket);
+        }
+        catch (const Azure::Core::RequestFailedException &e)
+        {
+            if (e.StatusCode != Azure::Core::Http::HttpStatusCode::NotFound)
+            {
+                LogBadStatus(e, "Error removing directory");
+                result = kFailure;
+            }
+        }
+        catch (const std::exception &e)
+        {
+            LogBadStatus(e, "Error removing directory");
+            result = kFailure;
+        }
+        metadata_cache.Invalidate(names.bucket, path);
+        return result;
     }
 
-    // prevent integer overflow
-    if (WillSizeCountProductOverflow(size, count))
+    // the directory goes with everything below it
+    int result{kSuccess};
+    try
     {
-        LogError("Error on write: product size * count is too large, would overflow");
-        return -1;
+        DeleteBlobs(names.bucket, path, {});
+    }
+    catch (const std::exception &e)
+    {
+        LogBadStatus(e, "Error removing directory");
+        result = kFailure;
     }
 
-    const long long to_write = static_cast<long long>(size * count);
-/*
-    gcs::ObjectWriteStream &writer = stream_h.GetWriter().writer_;
-    writer.write(static_cast<const char *>(ptr), to_write);
-    if (writer.bad())
     {
-        LogBadStatus(writer.last_status(), "Error during upload");
-        return -1;
+        std::lock_guard<std::mutex> lock(made_directories_mutex);
+        made_directories.erase(MakeDirectoryKey(names.bucket, path));
     }
-    spdlog::debug("Write status after write: good {}, bad {}, fail {}",
-                  writer.good(), writer.bad(), writer.fail());
-*/
-    return to_write;
+    metadata_cache.Invalidate(names.bucket, path);
+
+    return result;
 }
 
-int driver_fflush(void *stream)
+int driver_mkdir(const char *filename)
 {
-    ERROR_ON_NULL_ARG(stream, "Error passing null stream pointer to fflush", -1);
+    OpTimer timer(DriverOp::kMkdir);
 
-    auto stream_it = FindHandle(stream);
-    ERROR_NO_STREAM(stream_it, -1);
-    Handle &stream_h = **stream_it;
+    ERROR_ON_NULL_ARG(filename, "Error passing null pointer to mkdir", kFailure);
 
-    if (HandleType::kWrite != stream_h.type)
-    {
-        LogError("Cannot flush on not writing stream");
-        return -1;
-    }
-/*
-    auto &out_stream = stream_h.GetWriter().writer_;
-    if (!out_stream.flush())
+    spdlog::debug("mkdir {}", filename);
+
+    assert(driver_isConnected());
+
+    auto maybe_names = GetServiceBucketAndObjectNames(filename);
+    if (!maybe_names.RawResponse && SHARE != maybe_names.Value.service)
     {
-        LogBadStatus(out_stream.last_status(), "Error during upload");
-        return -1;
+        // nothing to create in a blob container, remember the directory for dirExists
+        std::string path = maybe_names.Value.object;
+        if (!path.empty() && path.back() != '/')
+        {
+            path.push_back('/');
+        }
+        std::lock_guard<std::mutex> lock(made_directories_mutex);
+        made_directories.insert(MakeDirectoryKey(maybe_names.Value.bucket, path));
+        metadata_cache.Invalidate(maybe_names.Value.bucket, path);
     }
-*/
-    return 0;
+    return kSuccess;
 }
 
-int driver_remove(const char *filename)
+long long int driver_diskFreeSpace(const char *filename)
 {
-    ERROR_ON_NULL_ARG(filename, "Error passing null pointer to remove", kFailure);
+    OpTimer timer(DriverOp::kDiskFreeSpace);
 
-    spdlog::debug("remove {}", filename);
+    ERROR_ON_NULL_ARG(filename, "Error passing null pointer to diskFreeSpace", -1);
+
+    spdlog::debug("diskFreeSpace {}", filename);
 
     assert(driver_isConnected());
 
     auto maybe_names = GetServiceBucketAndObjectNames(filename);
+    ERROR_ON_NAMES(maybe_names, -1);
 
-    std::string blobName = maybe_names.Value.object;
-    std::cout << "Deleting blob: " << blobName << std::endl;
-    std::string containerName = maybe_names.Value.bucket;
-    auto containerClient = GetBlobServiceClient().GetBlobContainerClient(containerName);
+    if (SHARE != maybe_names.Value.service)
+    {
+        return blob_free_space;
+    }
 
-    // Create the block blob client
-    BlockBlobClient blobClient = containerClient.GetBlockBlobClient(blobName);
-    blobClient.Delete();
+    try
+    {
+        return share_free_space.Get(maybe_names.Value.bucket, GetShareServiceClient());
+    }
+    catch (const std::exception &e)
+    {
+        LogBadStatus(e, "Error getting free space of file share");
+        return -1;
+    }
+}
 
-/*
-    auto maybe_names = GetBucketAndObjectNames(filename);
-    ERROR_ON_NAMES(maybe_names, kFailure);
-    auto& names = *maybe_names;
+// Size of the ranges downloaded concurrently by copyToLocal
+constexpr tOffset copy_chunk_size{8 * 1024 * 1024};
 
-    const auto status = client.DeleteObject(names.bucket, names.object);
-    if (!status.ok() && status.code() != gc::StatusCode::kNotFound)
+#ifdef __unix_or_mac__
+void WriteAllAt(int fd, const char *data, size_t size, tOffset offset)
+{
+    while (size > 0)
     {
-        LogBadStatus(status, "Error deleting object");
-        return kFailure;
+        const ssize_t written = pwrite(fd, data, size, static_cast<off_t>(offset));
+        if (written < 0)
+        {
+            if (EINTR == errno)
+            {
+                continue;
+            }
+            throw std::runtime_error(std::string("Error while writing data to local file: ") + std::strerror(errno));
+        }
+        data += written;
+        size -= static_cast<size_t>(written);
+        offset += written;
     }
-*/
-    return kSuccess;
 }
 
-int driver_rmdir(const char *filename)
+void PreallocateLocalFile(int fd, tOffset size)
 {
-    ERROR_ON_NULL_ARG(filename, "Error passing null pointer to rmdir", kFailure);
-
-    spdlog::debug("rmdir {}", filename);
-
-    assert(driver_isConnected());
-    spdlog::debug("Remove dir (does nothing...)");
-    return kSuccess;
+#ifdef __linux__
+    if (0 == size || 0 == fallocate(fd, 0, 0, static_cast<off_t>(size)))
+    {
+        return;
+    }
+#endif
+    // not supported by the platform or the file system, at least set the final size
+    if (0 != ftruncate(fd, static_cast<off_t>(size)))
+    {
+        throw std::runtime_error(std::string("Error while allocating local file: ") + std::strerror(errno));
+    }
 }
 
-int driver_mkdir(const char *filename)
+// Downloads the logical content of multifile to a preallocated local file: parallel_read_concurrency
+// workers download successive chunks and write each one at its final position.
+void DownloadToLocalFile(const MultiPartFile &multifile, const char *local_path)
 {
-    ERROR_ON_NULL_ARG(filename, "Error passing null pointer to mkdir", kFailure);
+    const int fd = open(local_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+    {
+        std::ostringstream os;
+        os << "Failed to open local file for writing: " << local_path << ": " << std::strerror(errno);
+        throw std::runtime_error(os.str());
+    }
 
-    spdlog::debug("mkdir {}", filename);
+    const tOffset total_size = multifile.total_size_;
+    std::exception_ptr error;
+    try
+    {
+        PreallocateLocalFile(fd, total_size);
 
-    assert(driver_isConnected());
-    return kSuccess;
-}
+        std::atomic<tOffset> next_offset{0};
+        std::atomic<bool> stop{false};
+        auto copy_chunks = [&multifile, &next_offset, &stop, fd, total_size]()
+        {
+            std::vector<char> buffer(static_cast<size_t>(std::min(copy_chunk_size, total_size)));
+            for (tOffset offset = next_offset.fetch_add(copy_chunk_size); offset < total_size && !stop;
+                 offset = next_offset.fetch_add(copy_chunk_size))
+            {
+                try
+                {
+                    const tOffset to_read = std::min(copy_chunk_size, total_size - offset);
+                    const long long num_read = ReadBytesAt(multifile, offset, buffer.data(), to_read);
+                    if (num_read < to_read)
+                    {
+                        throw std::runtime_error("Error while reading from cloud storage: object is shorter than expected");
+                    }
+                    WriteAllAt(fd, buffer.data(), static_cast<size_t>(num_read), offset);
+                }
+                catch (...)
+                {
+                    stop = true;
+                    throw;
+                }
+            }
+        };
 
-long long int driver_diskFreeSpace(const char *filename)
-{
-    ERROR_ON_NULL_ARG(filename, "Error passing null pointer to diskFreeSpace", kFailure);
+        const tOffset chunk_count = (total_size + copy_chunk_size - 1) / copy_chunk_size;
+        const size_t worker_count = static_cast<size_t>(std::max<tOffset>(1, std::min(static_cast<tOffset>(parallel_read_concurrency), chunk_count)));
+        std::vector<std::future<void>> workers;
+        for (size_t i = 0; i < worker_count; i++)
+        {
+            workers.push_back(LaunchInPool<void>(parallel_pool, copy_chunks));
+        }
+        for (auto &worker : workers)
+        {
+            try
+            {
+                worker.get();
+            }
+            catch (...)
+            {
+                if (!error)
+                {
+                    error = std::current_exception();
+                }
+            }
+        }
+    }
+    catch (...)
+    {
+        error = std::current_exception();
+    }
 
-    spdlog::debug("diskFreeSpace {}", filename);
+    if (0 != close(fd) && !error)
+    {
+        error = std::make_exception_ptr(std::runtime_error(std::string("Error while closing local file: ") + std::strerror(errno)));
+    }
 
-    assert(driver_isConnected());
-    constexpr long long free_space{5LL * 1024LL * 1024LL * 1024LL * 1024LL};
-    return free_space;
+    if (error)
+    {
+        // do not leave a preallocated file with holes behind
+        std::remove(local_path);
+        std::rethrow_exception(error);
+    }
+}
+#else
+void DownloadToLocalFile(const MultiPartFile &multifile, const char *local_path)
+{
+    std::ofstream file_stream(local_path, std::ios::binary);
+    if (!file_stream.is_open())
+    {
+        std::ostringstream os;
+        os << "Failed to open local file for writing: " << local_path;
+        throw std::runtime_error(os.str());
+    }
+
+    // Relay the logical content through the same range reads as the reader handles, hence through the caches
+    std::vector<char> buffer(static_cast<size_t>(preferred_buffer_size));
+    const tOffset total_size = multifile.total_size_;
+    for (tOffset offset = 0; offset < total_size;)
+    {
+        const tOffset to_read = std::min(preferred_buffer_size, total_size - offset);
+        const long long num_read = ReadBytesAt(multifile, offset, buffer.data(), to_read);
+        if (num_read < to_read)
+        {
+            throw std::runtime_error("Error while reading from cloud storage: object is shorter than expected");
+        }
+        if (!file_stream.write(buffer.data(), static_cast<std::streamsize>(num_read)))
+        {
+            throw std::runtime_error("Error while writing data to local file");
+        }
+        offset += num_read;
+    }
 }
+#endif
 
 int driver_copyToLocal(const char *sSourceFilePathName, const char *sDestFilePathName)
 {
+    OpTimer timer(DriverOp::kCopyToLocal);
+
     assert(driver_isConnected());
 
     if (!sSourceFilePathName || !sDestFilePathName)
@@ -1329,209 +5088,291 @@ int driver_copyToLocal(const char *sSourceFilePathName, const char *sDestFilePat
     }
 
     spdlog::debug("copyToLocal {} {}", sSourceFilePathName, sDestFilePathName);
-/*
-    auto maybe_names = GetBucketAndObjectNames(sSourceFilePathName);
+    auto maybe_names = GetServiceBucketAndObjectNames(sSourceFilePathName);
     ERROR_ON_NAMES(maybe_names, kFailure);
 
-    const std::string& bucket_name = maybe_names->bucket;
-    const std::string& object_name = maybe_names->object;
-
-    auto maybe_reader = MakeReaderPtr(bucket_name, object_name);
-    RETURN_ON_ERROR(maybe_reader, "Error while opening Remote file", kFailure);
+    auto &names = maybe_names.Value;
 
-    ReaderPtr& reader = *maybe_reader;
-    const size_t nb_files = reader->filenames_.size();
-
-    // Open the local file
-    std::ofstream file_stream(sDestFilePathName, std::ios::binary);
-    if (!file_stream.is_open())
+    try
     {
-        std::ostringstream os;
-        os << "Failed to open local file for writing: " << sDestFilePathName;
-        LogError(os.str());
+        ReaderPtr reader = MakeReaderPtr(std::move(names.bucket), std::move(names.object), names.service);
+        DownloadToLocalFile(*reader, sDestFilePathName);
+    }
+    catch (const std::exception &e)
+    {
+        LogBadStatus(e, "Error while copying to local file");
         return kFailure;
     }
 
-    // Allocate a relay buffer
-    constexpr size_t buf_size{1024};
-    std::array<char, buf_size> buffer{};
-    char *buf_data = buffer.data();
+    // done copying
+    spdlog::debug("Done copying");
 
-    // create a waste buffer now, so the lambdas can reference it
-    // memory allocation will occur later, before actual use
-    std::vector<char> waste;
+    return kSuccess;
+}
 
-    auto read_and_write = [&](gcs::ObjectReadStream &from, bool skip_header = false, std::streamsize header_size = 0)
+// Block size of a copyFromLocal upload: the configured write block size, unless the file would then
+// need more blocks than a blob can have
+size_t UploadBlockSizeFor(tOffset file_size)
+{
+    const tOffset min_block_size = (file_size + static_cast<tOffset>(max_block_count) - 1) / static_cast<tOffset>(max_block_count);
+    if (min_block_size > max_block_size)
     {
-        if (!from)
-        {
-            LogBadStatus(from.status(), "Error initializing download stream");
-            return false;
-        }
+        throw std::runtime_error("File is too large to be uploaded as a block blob");
+    }
+    return static_cast<size_t>(std::max(write_block_size, min_block_size));
+}
 
-        if (skip_header)
+// Uploads chunks 0 to chunk_count - 1 with upload_chunk(i), from up to write_max_concurrency workers.
+// The workers stop picking new chunks after the first failure, which is rethrown once all are done.
+void UploadChunksInParallel(size_t chunk_count, const std::function<void(size_t)> &upload_chunk)
+{
+    std::atomic<size_t> next_chunk{0};
+    std::atomic<bool> stop{false};
+    auto upload_chunks = [&]()
+    {
+        for (size_t i = next_chunk++; i < chunk_count && !stop; i = next_chunk++)
         {
-            // according to gcs sources, seekg is not implemented
-            // waste a read on the first bytes
-            if (!from.read(waste.data(), header_size))
+            try
             {
-                // check failure reasons to give feedback
-                std::string err_msg;
-                if (from.eof())
-                {
-                    err_msg = "Error reading header. Shorter header than expected";
-                }
-                else if (from.bad())
-                {
-                    err_msg = "Error reading header. Read failed";
-                }
-                LogBadStatus(from.status(), err_msg);
-                return false;
+                upload_chunk(i);
+            }
+            catch (...)
+            {
+                stop = true;
+                throw;
             }
         }
+    };
 
-        const std::streamsize buf_size_cast = static_cast<std::streamsize>(buf_size);
-        while (from.read(buf_data, buf_size_cast) && file_stream.write(buf_data, buf_size_cast))
-        {
-        }
-        // what made the process stop?
-        if (!file_stream)
+    std::exception_ptr error;
+    std::vector<std::future<void>> workers;
+    const size_t worker_count = std::max<size_t>(1, std::min(write_max_concurrency, chunk_count));
+    for (size_t i = 0; i < worker_count; i++)
+    {
+        workers.push_back(LaunchInPool<void>(parallel_pool, upload_chunks));
+    }
+    for (auto &worker : workers)
+    {
+        try
         {
-            // something went wrong on write side, abort
-            LogError("Error while writing data to local file");
-            return false;
+            worker.get();
         }
-        else if (from.eof())
+        catch (...)
         {
-            // short read, copy what remains, if any
-            const std::streamsize rem = from.gcount();
-            if (rem > 0 && !file_stream.write(buf_data, rem))
+            if (!error)
             {
-                // something went wrong on write side, abort
-                LogError("Error while writing data to local file");
-                return false;
+                error = std::current_exception();
             }
         }
-        else if (from.bad())
-        {
-            // something went wrong on read side
-            LogBadStatus(from.status(), "Error while reading from cloud storage");
-            return false;
-        }
-
-        return true;
-    };
+    }
 
-    auto operation = [&](gcs::ObjectReadStream &from, const std::string &filename, bool skip_header = false, tOffset header_size = 0)
+    if (error)
     {
-        from = client.ReadObject(bucket_name, filename);
-        bool res = read_and_write(from, skip_header, header_size);
-        from.Close();
-        return res;
-    };
+        std::rethrow_exception(error);
+    }
+}
 
-    auto &filenames = reader->filenames_;
+#ifdef __unix_or_mac__
+// Memory-maps the local file and calls use_content on the mapping, which is released afterwards.
+// use_content gets a null pointer for an empty file, there being nothing to map.
+void WithLocalFileMapping(const char *local_path, const std::function<void(const char *, tOffset)> &use_content)
+{
+    const int fd = open(local_path, O_RDONLY);
+    if (fd < 0)
+    {
+        std::ostringstream os;
+        os << "Failed to open local file: " << local_path << ": " << std::strerror(errno);
+        throw std::runtime_error(os.str());
+    }
 
-    // Read the whole first file
-    gcs::ObjectReadStream read_stream;
-    if (!operation(read_stream, filenames.front()))
+    struct stat file_stat;
+    if (0 != fstat(fd, &file_stat))
     {
-        return kFailure;
+        const int fstat_errno = errno;
+        close(fd);
+        throw std::runtime_error(std::string("Error while reading on local storage: ") + std::strerror(fstat_errno));
     }
 
-    // fast exit
-    if (nb_files == 1)
+    const tOffset file_size = static_cast<tOffset>(file_stat.st_size);
+    if (0 == file_size)
     {
-        return kSuccess;
+        close(fd);
+        use_content(nullptr, 0);
+        return;
     }
 
-    // Read from the next files
-    const tOffset header_size = reader->commonHeaderLength_;
-    const bool skip_header = header_size > 0;
-    waste.reserve(static_cast<size_t>(header_size));
+    void *mapping = mmap(nullptr, static_cast<size_t>(file_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    const int mmap_errno = errno;
+    // the mapping stays valid once the descriptor is closed
+    close(fd);
+    if (MAP_FAILED == mapping)
+    {
+        throw std::runtime_error(std::string("Error while mapping local file: ") + std::strerror(mmap_errno));
+    }
+    madvise(mapping, static_cast<size_t>(file_size), MADV_SEQUENTIAL);
 
-    for (size_t i = 1; i < nb_files; i++)
+    try
+    {
+        use_content(static_cast<const char *>(mapping), file_size);
+    }
+    catch (...)
     {
-        if (!operation(read_stream, filenames[i], skip_header, header_size))
+        munmap(mapping, static_cast<size_t>(file_size));
+        throw;
+    }
+    munmap(mapping, static_cast<size_t>(file_size));
+}
+
+// Stages the blocks directly from the mapping of the local file, write_max_concurrency at a time, then
+// commits them all at once.
+void UploadFromLocalFile(const char *local_path, const BlockBlobClient &client)
+{
+    WithLocalFileMapping(local_path, [&client](const char *data, tOffset file_size)
+                         {
+        if (0 == file_size)
         {
-            return kFailure;
+            // an empty block list makes an empty blob
+            client.CommitBlockList({});
+            return;
         }
-    }
 
-    // done copying
-    spdlog::debug("Done copying");
-*/
+        const tOffset block_size = static_cast<tOffset>(UploadBlockSizeFor(file_size));
+        const size_t block_count = static_cast<size_t>((file_size + block_size - 1) / block_size);
+        const std::string id_prefix = MakeUploadId();
+        std::vector<std::string> block_ids;
+        for (size_t i = 0; i < block_count; i++)
+        {
+            block_ids.push_back(MakeBlockId(id_prefix, i));
+        }
 
-    return kSuccess;
+        UploadChunksInParallel(block_count, [&](size_t i)
+                               {
+            const tOffset start = static_cast<tOffset>(i) * block_size;
+            const size_t length = static_cast<size_t>(std::min(block_size, file_size - start));
+            Azure::Core::IO::MemoryBodyStream body(reinterpret_cast<const uint8_t *>(data + start), length);
+            client.StageBlock(block_ids[i], body); });
+
+        client.CommitBlockList(block_ids); });
 }
 
-int driver_copyFromLocal(const char *sSourceFilePathName, const char *sDestFilePathName)
+// The file of the share is created at its final size, then its ranges are written in place from the
+// mapping of the local file, write_max_concurrency at a time.
+void UploadFromLocalFile(const char *local_path, const ShareFileClient &client, const std::string &share_name)
 {
-    if (!sSourceFilePathName || !sDestFilePathName)
+    WithLocalFileMapping(local_path, [&](const char *data, tOffset file_size)
+                         {
+        // an existing file is replaced, only the difference in size is consumed
+        const tOffset previous_size = GetShareFileSizeOrZero(client);
+        client.Create(file_size);
+        share_free_space.Consume(share_name, file_size - previous_size);
+
+        const size_t range_count = static_cast<size_t>((file_size + max_file_range_size - 1) / max_file_range_size);
+        UploadChunksInParallel(range_count, [&](size_t i)
+                               {
+            const tOffset start = static_cast<tOffset>(i) * max_file_range_size;
+            const size_t length = static_cast<size_t>(std::min(max_file_range_size, file_size - start));
+            Azure::Core::IO::MemoryBodyStream body(reinterpret_cast<const uint8_t *>(data + start), length);
+            client.UploadRange(start, body); }); });
+}
+#else
+void UploadFromLocalFile(const char *local_path, const BlockBlobClient &client)
+{
+    std::ifstream file_stream(local_path, std::ios::binary | std::ios::ate);
+    if (!file_stream.is_open())
     {
-        LogError("Error passing null pointers as arguments to copyFromLocal");
-        return kFailure;
+        std::ostringstream os;
+        os << "Failed to open local file: " << local_path;
+        throw std::runtime_error(os.str());
     }
+    const tOffset file_size = static_cast<tOffset>(file_stream.tellg());
+    file_stream.seekg(0);
 
-    spdlog::debug("copyFromLocal {} {}", sSourceFilePathName, sDestFilePathName);
+    // same staged upload as a writer handle, with a block size large enough for the whole file
+    auto upload = MakeBlockUpload(client, UploadBlockSizeFor(file_size));
 
-    assert(driver_isConnected());
-/*
-    auto maybe_names = GetBucketAndObjectNames(sDestFilePathName);
-    ERROR_ON_NAMES(maybe_names, kFailure);
+    std::vector<char> buffer(static_cast<size_t>(preferred_buffer_size));
+    while (file_stream.read(buffer.data(), static_cast<std::streamsize>(buffer.size())) || file_stream.gcount() > 0)
+    {
+        WriteToUpload(*upload, buffer.data(), static_cast<size_t>(file_stream.gcount()));
+    }
+    if (file_stream.bad())
+    {
+        throw std::runtime_error("Error while reading on local storage");
+    }
+    CommitUpload(*upload);
+}
 
-    // Open the local file
-    std::ifstream file_stream(sSourceFilePathName, std::ios::binary);
+void UploadFromLocalFile(const char *local_path, const ShareFileClient &client, const std::string &share_name)
+{
+    std::ifstream file_stream(local_path, std::ios::binary | std::ios::ate);
     if (!file_stream.is_open())
     {
         std::ostringstream os;
-        os << "Failed to open local file: " << sSourceFilePathName;
-        LogError(os.str());
-        return kFailure;
+        os << "Failed to open local file: " << local_path;
+        throw std::runtime_error(os.str());
     }
-
-    // Create a WriteObject stream
-    const auto& names = *maybe_names;
-    auto writer = client.WriteObject(names.bucket, names.object);
-    if (!writer || !writer.IsOpen())
+    const tOffset file_size = static_cast<tOffset>(file_stream.tellg());
+    file_stream.seekg(0);
+
+    // same ranged upload as a writer handle, on a file created at its final size
+    const tOffset previous_size = GetShareFileSizeOrZero(client);
+    client.Create(file_size);
+    // the ranges are charged as they are uploaded, the replaced file gives its space back
+    share_free_space.Consume(share_name, -previous_size);
+    auto upload = MakeRangeUpload(client, share_name, 0, file_size);
+
+    std::vector<char> buffer(static_cast<size_t>(preferred_buffer_size));
+    while (file_stream.read(buffer.data(), static_cast<std::streamsize>(buffer.size())) || file_stream.gcount() > 0)
     {
-        LogBadStatus(writer.metadata().status(), "Error initializing upload stream to remote storage");
-        return kFailure;
+        WriteToRangeUpload(*upload, buffer.data(), static_cast<size_t>(file_stream.gcount()));
+    }
+    if (file_stream.bad())
+    {
+        throw std::runtime_error("Error while reading on local storage");
     }
+    FlushRangeUpload(*upload);
+}
+#endif
 
-    // Read from the local file and write to the GCS object
-    constexpr size_t buf_size{1024};
-    std::array<char, buf_size> buffer{};
-    char *buf_data = buffer.data();
+int driver_copyFromLocal(const char *sSourceFilePathName, const char *sDestFilePathName)
+{
+    OpTimer timer(DriverOp::kCopyFromLocal);
 
-    while (file_stream.read(buf_data, buf_size) && writer.write(buf_data, buf_size)){}
-    // what made the process stop?
-    if (!writer)
+    if (!sSourceFilePathName || !sDestFilePathName)
     {
-        LogBadStatus(writer.last_status(), "Error while copying to remote storage");
+        LogError("Error passing null pointers as arguments to copyFromLocal");
         return kFailure;
     }
-    else if (file_stream.eof())
+
+    spdlog::debug("copyFromLocal {} {}", sSourceFilePathName, sDestFilePathName);
+
+    assert(driver_isConnected());
+
+    auto maybe_names = GetServiceBucketAndObjectNames(sDestFilePathName);
+    ERROR_ON_NAMES(maybe_names, kFailure);
+
+    const auto &names = maybe_names.Value;
+
+    std::string object_name;
+    try
     {
-        // copy what remains in the buffer
-        const auto rem = file_stream.gcount();
-        if (rem > 0 && !writer.write(buf_data, rem))
+        object_name = GetWrittenObjectName(names);
+        if (SHARE == names.service)
         {
-            LogError("Error while copying to remote storage");
-            return kFailure;
+            UploadFromLocalFile(sSourceFilePathName, GetShareFileClient(names.bucket, object_name), names.bucket);
+        }
+        else
+        {
+            UploadFromLocalFile(sSourceFilePathName, GetBlockBlobClient(names.bucket, object_name));
         }
     }
-    else if (file_stream.bad())
+    catch (const std::exception &e)
     {
-        LogError("Error while reading on local storage");
+        LogBadStatus(e, "Error while copying to remote storage");
         return kFailure;
     }
 
-    // Close the GCS WriteObject stream to complete the upload
-    writer.Close();
+    InvalidateCachedObject(names.bucket, object_name);
 
-    auto &maybe_meta = writer.metadata();
-    RETURN_ON_ERROR(maybe_meta, "Error during file upload to remote storage", kFailure);
-*/
     return kSuccess;
 }
@@ -135,6 +135,11 @@ extern "C"
 	// Returns 1 on success, 0 on error
 	VISIBLE int driver_copyFromLocal(const char *sourcefilename, const char *destfilename);
 
+	// Returns a JSON snapshot of the statistics of the driver since it was loaded: latency histograms of the
+	// driver functions and of the HTTP requests, transferred bytes, retries and cache hits
+	// The string is valid until the next call on the same thread
+	VISIBLE const char *driver_getStats();
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif /* __cplusplus */
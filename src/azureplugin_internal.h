@@ -1,7 +1,14 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
 #include <memory>
+#include <mutex>
+#include <stdexcept>
 #include <string>
+#include <utility>
 #include <vector>
 
 //#include <google/cloud/storage/object_write_stream.h>
@@ -62,6 +69,389 @@ namespace azureplugin
 
     using tOffset = long long;
 
+    enum Service {
+      UNKNOWN = 0,
+      BLOB,
+      SHARE
+    };
+
+    struct ReadAhead;
+    struct ReadStream;
+    struct PartClients;
+    struct BlockUpload;
+    struct RangeUpload;
+
+    // Immutable list of the parts of a multi-part file: their names, ETags and sizes, the size of a part being
+    // the number of bytes it adds to the logical content. Stored compactly for exports of many parts, and
+    // shared by the readers of the same file:
+    //  - the names lose their common prefix and are front coded against the previous name, as are the ETags
+    //  - the sizes are varint encoded
+    //  - every kBlockSize parts, a restart point allows decoding from there
+    // Finding the part holding an offset is a branch-free search among the starting offsets of the restart
+    // points, laid out in Eytzinger order, then a scan of at most kBlockSize sizes.
+    class PartManifest
+    {
+    public:
+        static constexpr size_t kBlockSize = 16;
+
+        // cumulative_sizes[i] is the logical offset of the end of part i, etags may be empty
+        PartManifest(const std::vector<std::string>& names,
+            const std::vector<long long>& cumulative_sizes,
+            const std::vector<std::string>& etags = {})
+            : count_{ names.size() }
+            , has_etags_{ !etags.empty() }
+        {
+            if (cumulative_sizes.size() != count_ || (has_etags_ && etags.size() != count_))
+            {
+                throw std::invalid_argument("Inconsistent number of parts in manifest");
+            }
+
+            if (count_ > 0)
+            {
+                prefix_ = names.front();
+                for (const auto& name : names)
+                {
+                    prefix_.resize(CommonPrefixLength(prefix_, name));
+                }
+            }
+
+            std::string previous_name;
+            std::string previous_etag;
+            for (size_t i = 0; i < count_; i++)
+            {
+                const long long start = (i == 0) ? 0 : cumulative_sizes[i - 1];
+                if (cumulative_sizes[i] < start)
+                {
+                    throw std::invalid_argument("Decreasing cumulative sizes in manifest");
+                }
+
+                const bool restart = (i % kBlockSize == 0);
+                if (restart)
+                {
+                    blocks_.push_back(Block{ names_.size(), etags_.size(), sizes_.size(), start });
+                }
+
+                const std::string name = names[i].substr(prefix_.size());
+                AppendFrontCoded(names_, previous_name, name, restart);
+                previous_name = name;
+                if (has_etags_)
+                {
+                    AppendFrontCoded(etags_, previous_etag, etags[i], restart);
+                    previous_etag = etags[i];
+                }
+                AppendVarint(sizes_, static_cast<unsigned long long>(cumulative_sizes[i] - start));
+            }
+            total_size_ = count_ > 0 ? cumulative_sizes.back() : 0;
+
+            search_keys_.resize(blocks_.size() + 1);
+            search_blocks_.resize(blocks_.size() + 1);
+            BuildSearchTree(0, 1);
+        }
+
+        size_t Count() const { return count_; }
+
+        long long TotalSize() const { return total_size_; }
+
+        std::string Name(size_t part) const
+        {
+            const Block& block = blocks_[part / kBlockSize];
+            return prefix_ + DecodeFrontCoded(names_, block.names_pos, part % kBlockSize);
+        }
+
+        // Empty if the manifest was built without ETags
+        std::string ETag(size_t part) const
+        {
+            if (!has_etags_)
+            {
+                return {};
+            }
+            const Block& block = blocks_[part / kBlockSize];
+            return DecodeFrontCoded(etags_, block.etags_pos, part % kBlockSize);
+        }
+
+        long long PartSize(size_t part) const
+        {
+            size_t pos = blocks_[part / kBlockSize].sizes_pos;
+            for (size_t i = 0; i < part % kBlockSize; i++)
+            {
+                ReadVarint(sizes_, pos);
+            }
+            return static_cast<long long>(ReadVarint(sizes_, pos));
+        }
+
+        // Returns the part holding the byte at the logical offset, and sets part_start to the logical offset
+        // of the beginning of that part. Returns Count() if the offset is past the end.
+        size_t FindPart(long long offset, long long& part_start) const
+        {
+            part_start = total_size_;
+            if (offset >= total_size_ || offset < 0)
+            {
+                return count_;
+            }
+
+            // first restart point starting after offset, 0 if none
+            size_t k = 1;
+            while (k < search_keys_.size())
+            {
+                k = 2 * k + (search_keys_[k] <= offset ? 1 : 0);
+            }
+            while (k & 1)
+            {
+                k >>= 1;
+            }
+            k >>= 1;
+            const size_t block_index = (k == 0 ? blocks_.size() : search_blocks_[k]) - 1;
+
+            const Block& block = blocks_[block_index];
+            size_t pos = block.sizes_pos;
+            long long start = block.start;
+            const size_t end_part = std::min(count_, (block_index + 1) * kBlockSize);
+            for (size_t part = block_index * kBlockSize; part < end_part; part++)
+            {
+                const long long size = static_cast<long long>(ReadVarint(sizes_, pos));
+                if (start + size > offset)
+                {
+                    part_start = start;
+                    return part;
+                }
+                start += size;
+            }
+            return count_;
+        }
+
+        // Calls f(name, etag, size) on each part, in order
+        template <typename F>
+        void ForEachPart(F f) const
+        {
+            std::string name;
+            std::string etag;
+            size_t names_pos = 0;
+            size_t etags_pos = 0;
+            size_t sizes_pos = 0;
+            for (size_t i = 0; i < count_; i++)
+            {
+                ReadFrontCoded(names_, names_pos, name);
+                if (has_etags_)
+                {
+                    ReadFrontCoded(etags_, etags_pos, etag);
+                }
+                f(prefix_ + name, etag, static_cast<long long>(ReadVarint(sizes_, sizes_pos)));
+            }
+        }
+
+        bool operator==(const PartManifest& other) const
+        {
+            return count_ == other.count_
+                && has_etags_ == other.has_etags_
+                && prefix_ == other.prefix_
+                && names_ == other.names_
+                && etags_ == other.etags_
+                && sizes_ == other.sizes_;
+        }
+
+    private:
+        struct Block
+        {
+            size_t names_pos;
+            size_t etags_pos;
+            size_t sizes_pos;
+            long long start;
+        };
+
+        static size_t CommonPrefixLength(const std::string& a, const std::string& b)
+        {
+            size_t n = 0;
+            while (n < a.size() && n < b.size() && a[n] == b[n])
+            {
+                n++;
+            }
+            return n;
+        }
+
+        static void AppendVarint(std::string& out, unsigned long long value)
+        {
+            while (value >= 0x80)
+            {
+                out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+                value >>= 7;
+            }
+            out.push_back(static_cast<char>(value));
+        }
+
+        static unsigned long long ReadVarint(const std::string& in, size_t& pos)
+        {
+            unsigned long long value = 0;
+            for (unsigned shift = 0;; shift += 7)
+            {
+                const auto byte = static_cast<unsigned char>(in[pos++]);
+                value |= static_cast<unsigned long long>(byte & 0x7f) << shift;
+                if (!(byte & 0x80))
+                {
+                    return value;
+                }
+            }
+        }
+
+        // an entry is the length shared with the previous value, then the length and bytes of the rest
+        static void AppendFrontCoded(std::string& out, const std::string& previous, const std::string& value, bool restart)
+        {
+            const size_t shared = restart ? 0 : CommonPrefixLength(previous, value);
+            AppendVarint(out, shared);
+            AppendVarint(out, value.size() - shared);
+            out.append(value, shared, std::string::npos);
+        }
+
+        static void ReadFrontCoded(const std::string& in, size_t& pos, std::string& value)
+        {
+            const size_t shared = static_cast<size_t>(ReadVarint(in, pos));
+            const size_t rest = static_cast<size_t>(ReadVarint(in, pos));
+            value.resize(shared);
+            value.append(in, pos, rest);
+            pos += rest;
+        }
+
+        // decodes the value skip entries past a restart point
+        static std::string DecodeFrontCoded(const std::string& in, size_t pos, size_t skip)
+        {
+            std::string value;
+            for (size_t i = 0; i <= skip; i++)
+            {
+                ReadFrontCoded(in, pos, value);
+            }
+            return value;
+        }
+
+        // fills the 1-based Eytzinger layout of the block starts by an in-order walk
+        size_t BuildSearchTree(size_t block_index, size_t k)
+        {
+            if (k < search_keys_.size())
+            {
+                block_index = BuildSearchTree(block_index, 2 * k);
+                search_keys_[k] = blocks_[block_index].start;
+                search_blocks_[k] = block_index++;
+                block_index = BuildSearchTree(block_index, 2 * k + 1);
+            }
+            return block_index;
+        }
+
+        size_t count_{ 0 };
+        bool has_etags_{ false };
+        long long total_size_{ 0 };
+        std::string prefix_;
+        std::string names_;
+        std::string etags_;
+        std::string sizes_;
+        std::vector<Block> blocks_;
+        std::vector<long long> search_keys_;
+        std::vector<size_t> search_blocks_;
+    };
+
+    // Histogram of latencies in nanoseconds, with HDR-style log-linear buckets: exact below 16 ns, then
+    // kSubBuckets buckets per power of two, for a relative error under 1 / kSubBuckets.
+    // Recording is a few relaxed atomic increments, so that histograms can stay on all the time. Reading
+    // while recording gives a snapshot that may miss the records in progress.
+    class LatencyHistogram
+    {
+    public:
+        static constexpr unsigned kSubBucketBits{ 3 };
+        static constexpr size_t kSubBuckets{ size_t{ 1 } << kSubBucketBits };
+        static constexpr size_t kBucketCount{ (64 - kSubBucketBits + 1) * kSubBuckets };
+
+        LatencyHistogram()
+        {
+            for (auto& count : counts_)
+            {
+                count.store(0, std::memory_order_relaxed);
+            }
+        }
+
+        LatencyHistogram(const LatencyHistogram&) = delete;
+        LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+
+        void Record(uint64_t value)
+        {
+            counts_[BucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+            count_.fetch_add(1, std::memory_order_relaxed);
+            sum_.fetch_add(value, std::memory_order_relaxed);
+            uint64_t max = max_.load(std::memory_order_relaxed);
+            while (value > max && !max_.compare_exchange_weak(max, value, std::memory_order_relaxed))
+            {
+            }
+        }
+
+        uint64_t Count() const { return count_.load(std::memory_order_relaxed); }
+        uint64_t Sum() const { return sum_.load(std::memory_order_relaxed); }
+        uint64_t Max() const { return max_.load(std::memory_order_relaxed); }
+        uint64_t BucketCount(size_t index) const { return counts_[index].load(std::memory_order_relaxed); }
+
+        // highest value of the bucket holding the given percentile of the records, capped by the maximum
+        uint64_t ValueAtPercentile(double percentile) const
+        {
+            uint64_t total{ 0 };
+            for (const auto& count : counts_)
+            {
+                total += count.load(std::memory_order_relaxed);
+            }
+            if (0 == total)
+            {
+                return 0;
+            }
+
+            const uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(percentile / 100.0 * static_cast<double>(total) + 0.5));
+            uint64_t seen{ 0 };
+            for (size_t i = 0; i + 1 < kBucketCount; i++)
+            {
+                seen += counts_[i].load(std::memory_order_relaxed);
+                if (seen >= rank)
+                {
+                    return std::min(BucketLowerBound(i + 1) - 1, Max());
+                }
+            }
+            return Max();
+        }
+
+        static size_t BucketIndex(uint64_t value)
+        {
+            if (value < kSubBuckets)
+            {
+                return static_cast<size_t>(value);
+            }
+            const unsigned high_bit = HighBit(value);
+            const uint64_t sub_bucket = (value >> (high_bit - kSubBucketBits)) & (kSubBuckets - 1);
+            return (high_bit - kSubBucketBits + 1) * kSubBuckets + static_cast<size_t>(sub_bucket);
+        }
+
+        static uint64_t BucketLowerBound(size_t index)
+        {
+            if (index < kSubBuckets)
+            {
+                return index;
+            }
+            const unsigned high_bit = static_cast<unsigned>(index / kSubBuckets) + kSubBucketBits - 1;
+            return static_cast<uint64_t>(kSubBuckets + index % kSubBuckets) << (high_bit - kSubBucketBits);
+        }
+
+    private:
+        static unsigned HighBit(uint64_t value)
+        {
+            unsigned bit{ 0 };
+            for (unsigned shift = 32; shift > 0; shift /= 2)
+            {
+                if (value >> shift)
+                {
+                    value >>= shift;
+                    bit += shift;
+                }
+            }
+            return bit;
+        }
+
+        std::array<std::atomic<uint64_t>, kBucketCount> counts_;
+        std::atomic<uint64_t> count_{ 0 };
+        std::atomic<uint64_t> sum_{ 0 };
+        std::atomic<uint64_t> max_{ 0 };
+    };
+
     struct MultiPartFile
     {
         std::string bucketname_;
@@ -69,17 +459,27 @@ namespace azureplugin
         tOffset offset_{ 0 };
         // Added for multifile support
         tOffset commonHeaderLength_{ 0 };
-        std::vector<std::string> filenames_;
-        std::vector<tOffset> cumulativeSize_;
+        // Parts, with their ETags when the reader was opened
+        std::shared_ptr<const PartManifest> parts_;
         tOffset total_size_{ 0 };
+        // Background downloads ahead of the current offset
+        std::shared_ptr<ReadAhead> readAhead_;
+        // Download in progress of a streaming reader
+        std::shared_ptr<ReadStream> readStream_;
+        // Files of a share are read through the file service, anything else as blobs
+        Service service_{ BLOB };
+        // Clients of the parts, resolved when the reader is opened
+        std::shared_ptr<const PartClients> clients_;
     };
 
     struct WriteFile
     {
         std::string bucketname_;
         std::string filename_;
-        std::string append_target_;
-        //google::cloud::storage::ObjectWriteStream writer_;
+        // Blocks staged so far, committed on close
+        std::shared_ptr<BlockUpload> upload_;
+        // Set instead of upload_ for a file of a share, written in place
+        std::shared_ptr<RangeUpload> range_upload_;
     };
 
     using Reader = MultiPartFile;
@@ -120,6 +520,8 @@ namespace azureplugin
     {
         HandleType type;
         ClientVariant var;
+        // held for the duration of each call on the handle
+        std::mutex mutex;
 
         Handle(HandleType p_type)
             : type{ p_type }
@@ -141,9 +543,166 @@ namespace azureplugin
         Writer& GetWriter() { return *(var.writer); }
     };
 
-    using HandlePtr = std::unique_ptr<Handle>;
-    using HandleContainer = std::vector<HandlePtr>;
-    using HandleIt = HandleContainer::iterator;
+    // shared, so that a call in progress keeps its handle alive while another thread closes it
+    using HandlePtr = std::shared_ptr<Handle>;
+
+    // Slot map of handles.
+    // The key of a handle encodes its slot index (plus one, to never be zero) in the low half and the
+    // generation of the slot in the high half, minus kReservedBits left free for the caller. Removing a
+    // handle bumps the generation of its slot before the slot is reused, so looking a key up is O(1)
+    // and a stale key is rejected.
+    class HandleTable
+    {
+    public:
+        static constexpr unsigned kReservedBits = 4;
+
+        uintptr_t Insert(HandlePtr handle)
+        {
+            uintptr_t index;
+            if (free_.empty())
+            {
+                index = slots_.size();
+                slots_.emplace_back();
+            }
+            else
+            {
+                index = free_.back();
+                free_.pop_back();
+            }
+            Slot &slot = slots_[index];
+            slot.handle = std::move(handle);
+            return (slot.generation << kIndexBits) | (index + 1);
+        }
+
+        // empty if key is not in the table
+        HandlePtr Find(uintptr_t key) const
+        {
+            const Slot *slot = FindSlot(key);
+            return slot ? slot->handle : nullptr;
+        }
+
+        // empty if key is not in the table
+        HandlePtr Remove(uintptr_t key)
+        {
+            Slot *slot = const_cast<Slot *>(FindSlot(key));
+            if (!slot)
+            {
+                return nullptr;
+            }
+            HandlePtr handle = std::move(slot->handle);
+            slot->generation = (slot->generation + 1) & kGenerationMask;
+            free_.push_back(static_cast<uintptr_t>(slot - slots_.data()));
+            return handle;
+        }
+
+        // removes and returns all the handles
+        std::vector<HandlePtr> RemoveAll()
+        {
+            std::vector<HandlePtr> handles;
+            for (uintptr_t index = 0; index < slots_.size(); index++)
+            {
+                if (slots_[index].handle)
+                {
+                    handles.push_back(Remove((slots_[index].generation << kIndexBits) | (index + 1)));
+                }
+            }
+            return handles;
+        }
+
+    private:
+        static constexpr unsigned kIndexBits = sizeof(uintptr_t) * 4;
+        static constexpr uintptr_t kIndexMask = (uintptr_t{1} << kIndexBits) - 1;
+        static constexpr uintptr_t kGenerationMask = kIndexMask >> kReservedBits;
+
+        struct Slot
+        {
+            HandlePtr handle;
+            uintptr_t generation{0};
+        };
+
+        const Slot *FindSlot(uintptr_t key) const
+        {
+            const uintptr_t index_plus_one = key & kIndexMask;
+            if (0 == index_plus_one || index_plus_one > slots_.size())
+            {
+                return nullptr;
+            }
+            const Slot &slot = slots_[index_plus_one - 1];
+            if (!slot.handle || slot.generation != (key >> kIndexBits))
+            {
+                return nullptr;
+            }
+            return &slot;
+        }
+
+        std::vector<Slot> slots_;
+        std::vector<uintptr_t> free_;
+    };
+
+    // Open handles, spread over kShardCount independently locked tables so that threads opening,
+    // using and closing different streams rarely wait for each other.
+    // The opaque pointer given out for a handle is its table key shifted left by kShardBits, or-ed
+    // with the index of its shard.
+    class HandleRegistry
+    {
+    public:
+        void *Insert(HandlePtr handle)
+        {
+            const size_t shard_index = next_shard_++ % kShardCount;
+            Shard &shard = shards_[shard_index];
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            const uintptr_t key = shard.table.Insert(std::move(handle));
+            return reinterpret_cast<void *>((key << kShardBits) | shard_index);
+        }
+
+        // empty if handle is not open
+        HandlePtr Find(void *handle)
+        {
+            const uintptr_t value = reinterpret_cast<uintptr_t>(handle);
+            Shard &shard = shards_[value & kShardMask];
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            return shard.table.Find(value >> kShardBits);
+        }
+
+        // empty if handle is not open
+        HandlePtr Remove(void *handle)
+        {
+            const uintptr_t value = reinterpret_cast<uintptr_t>(handle);
+            Shard &shard = shards_[value & kShardMask];
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            return shard.table.Remove(value >> kShardBits);
+        }
+
+        std::vector<HandlePtr> RemoveAll()
+        {
+            std::vector<HandlePtr> handles;
+            for (auto &shard : shards_)
+            {
+                std::lock_guard<std::mutex> lock(shard.mutex);
+                for (auto &handle : shard.table.RemoveAll())
+                {
+                    handles.push_back(std::move(handle));
+                }
+            }
+            return handles;
+        }
+
+    private:
+        static constexpr unsigned kShardBits = HandleTable::kReservedBits;
+        static constexpr size_t kShardCount = size_t{1} << kShardBits;
+        static constexpr uintptr_t kShardMask = kShardCount - 1;
+
+        struct Shard
+        {
+            std::mutex mutex;
+            HandleTable table;
+        };
+
+        std::array<Shard, kShardCount> shards_;
+        std::atomic<size_t> next_shard_{0};
+    };
+
+    using HandleContainer = HandleRegistry;
 
 
     bool operator==(const MultiPartFile& op1, const MultiPartFile& op2)
@@ -152,8 +711,7 @@ namespace azureplugin
             && op1.filename_ == op2.filename_
             && op1.offset_ == op2.offset_
             && op1.commonHeaderLength_ == op2.commonHeaderLength_
-            && op1.filenames_ == op2.filenames_
-            && op1.cumulativeSize_ == op2.cumulativeSize_
+            && (op1.parts_ == op2.parts_ || (op1.parts_ && op2.parts_ && *op1.parts_ == *op2.parts_))
             && op1.total_size_ == op2.total_size_);
     }
 
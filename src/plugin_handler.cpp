@@ -60,7 +60,10 @@ namespace plgh
 			&& LoadLibraryFunction(&ptr_driver_fclose, "driver_fclose", true)
 			&& LoadLibraryFunction(&ptr_driver_fread, "driver_fread", true)
 			&& LoadLibraryFunction(&ptr_driver_fseek, "driver_fseek", true)
-			&& LoadLibraryFunction(&ptr_driver_getlasterror, "driver_getlasterror", true);
+			&& LoadLibraryFunction(&ptr_driver_getlasterror, "driver_getlasterror", true)
+
+			/* API functions definition, that can be defined optionally in the library */
+			&& LoadLibraryFunction(&ptr_driver_getStats, "driver_getStats", false);
 
 		if (load_success && !ptr_driver_isReadOnly())
 		{
@@ -60,6 +60,9 @@ namespace plgh
 		int (*ptr_driver_copyToLocal)(const char* sourcefilename, const char* destfilename);
 		int (*ptr_driver_copyFromLocal)(const char* sourcefilename, const char* destfilename);
 
+		/* API functions definition, that can be defined optionally in the library */
+		const char* (*ptr_driver_getStats)();
+
 
 		explicit PluginHandle(const std::string& lib_path);
 		~PluginHandle();
@@ -1,7 +1,9 @@
 #include "azureplugin.h"
 #include "azureplugin_internal.h"
 
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <cstring>
 #include <functional>
 #include <iostream>
@@ -10,6 +12,8 @@
 #include <iostream>
 #include <fstream>  
 #include <sstream>  
+#include <thread>
+#include <vector>
 
 #include <boost/process/environment.hpp>
 
@@ -19,6 +23,12 @@
 
 #include <gtest/gtest.h>
 
+#ifndef _WIN32
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 using namespace azureplugin;
 /*
 namespace gc = ::google::cloud;
@@ -84,6 +94,16 @@ TEST(AzureDriverTest, GetMultipartFileSize)
 	ASSERT_EQ(driver_disconnect(), kSuccess);
 }
 
+TEST(AzureDriverTest, GlobPatterns)
+{
+	ASSERT_EQ(driver_connect(), kSuccess);
+	ASSERT_EQ(driver_getFileSize("http://127.0.0.1:10000/devstoreaccount1/data-test-khiops-driver-azure/khiops_data/bq_export/Adult/Adult-split-00000000000[0-9].txt"), 5585568);
+	ASSERT_EQ(driver_fileExists("http://127.0.0.1:10000/devstoreaccount1/data-test-khiops-driver-azure/khiops_data/split/Adult_subsplit/**/Adult-split-0*.txt"), kTrue);
+	ASSERT_EQ(driver_fileExists("http://127.0.0.1:10000/devstoreaccount1/data-test-khiops-driver-azure/khiops_data/split/Adult/nothing-*.txt"), kFalse);
+	ASSERT_EQ(driver_getFileSize("http://127.0.0.1:10000/devstoreaccount1/data-test-khiops-driver-azure/khiops_data/split/Adult/nothing-*.txt"), -1);
+	ASSERT_EQ(driver_disconnect(), kSuccess);
+}
+
 TEST(AzureDriverTest, GetFileSizeNonexistentFailure)
 {
 	ASSERT_EQ(driver_connect(), kSuccess);
@@ -106,6 +126,578 @@ TEST(AzureDriverTest, DirExists)
 	ASSERT_EQ(driver_disconnect(), kSuccess);
 }
 
+TEST(AzureDriverTest, DirExistsNonexistent)
+{
+	const std::string dirname = "http://127.0.0.1:10000/devstoreaccount1/data-test-khiops-driver-azure/khiops_data/output/"
+		+ boost::uuids::to_string(boost::uuids::random_generator()()) + "/";
+
+	ASSERT_EQ(driver_connect(), kSuccess);
+	ASSERT_EQ(driver_dirExists("http://127.0.0.1:10000/devstoreaccount1/data-test-khiops-driver-azure/khiops_data/samples/non_existent_dir/"), kFalse);
+	ASSERT_EQ(driver_dirExists(dirname.c_str()), kFalse);
+	ASSERT_EQ(driver_mkdir(dirname.c_str()), kSuccess);
+	ASSERT_EQ(driver_dirExists(dirname.c_str()), kTrue);
+	ASSERT_EQ(driver_disconnect(), kSuccess);
+}
+
+TEST(AzureDriverTest, FileExistsFollowsWritesAndRemoves)
+{
+	const std::string filename = "http://127.0.0.1:10000/devstoreaccount1/data-test-khiops-driver-azure/khiops_data/output/"
+		+ boost::uuids::to_string(boost::uuids::random_generator()()) + ".txt";
+
+	ASSERT_EQ(driver_connect(), kSuccess);
+	ASSERT_EQ(driver_fileExists(filename.c_str()), kFalse);
+
+	// the cached answers must not hide the changes made through the driver
+	void* stream = driver_fopen(filename.c_str(), 'w');
+	ASSERT_NE(stream, nullptr);
+	ASSERT_EQ(driver_fwrite("12345", sizeof(char), 5, stream), 5);
+	ASSERT_EQ(driver_fclose(stream), 0);
+	ASSERT_EQ(driver_fileExists(filename.c_str()), kTrue);
+	ASSERT_EQ(driver_getFileSize(filename.c_str()), 5);
+
+	ASSERT_EQ(driver_remove(filename.c_str()), kSuccess);
+	ASSERT_EQ(driver_fileExists(filename.c_str()), kFalse);
+	ASSERT_EQ(driver_disconnect(), kSuccess);
+}
+
+TEST(AzureDriverTest, ReadSingleFile)
+{
+	ASSERT_EQ(driver_connect(), kSuccess);
+	void* stream = driver_fopen("http://127.0.0.1:10000/devstoreaccount1/data-test-khiops-driver-azure/khiops_data/samples/Adult/Adult.txt", 'r');
+	ASSERT_NE(stream, nullptr);
+
+	char buffer[6] = {};
+	ASSERT_EQ(driver_fread(buffer, sizeof(char), 5, stream), 5);
+	ASSERT_STREQ(buffer, "Label");
+
+	// read across the end of the file is shortened to the remaining bytes
+	ASSERT_EQ(driver_fseek(stream, 5585568 - 3, SEEK_SET), 0);
+	ASSERT_EQ(driver_fread(buffer, sizeof(char), 5, stream), 3);
+
+	ASSERT_EQ(driver_fclose(stream), 0);
+	ASSERT_EQ(driver_disconnect(), kSuccess);
+}
+
+TEST(AzureDriverTest, ReadMultipartFile)
+{
+	const long long file_size = 5585568;
+	auto read_all = [file_size](const char* filename, size_t step)
+	{
+		std::string content(file_size, '\0');
+		void* stream = driver_fopen(filename, 'r');
+		EXPECT_NE(stream, nullptr);
+		if (!stream)
+		{
+			return std::string();
+		}
+		size_t pos = 0;
+		while (pos < content.size())
+		{
+			const long long num_read = driver_fread(&content[pos], sizeof(char), std::min(step, content.size() - pos), stream);
+			EXPECT_GT(num_read, 0);
+			if (num_read <= 0)
+			{
+				break;
+			}
+			pos += static_cast<size_t>(num_read);
+		}
+		EXPECT_EQ(driver_fclose(stream), 0);
+		content.resize(pos);
+		return content;
+	};
+
+	ASSERT_EQ(driver_connect(), kSuccess);
+	const std::string expected = read_all("http://127.0.0.1:10000/devstoreaccount1/data-test-khiops-driver-azure/khiops_data/samples/Adult/Adult.txt", 4 * 1024 * 1024);
+	ASSERT_EQ((long long)expected.size(), file_size);
+
+	// the parts repeat the header, which is kept once; reads that do not align on the parts cross them
+	const std::string actual = read_all("http://127.0.0.1:10000/devstoreaccount1/data-test-khiops-driver-azure/khiops_data/bq_export/Adult/Adult-split-00000000000*.txt", 1000003);
+	ASSERT_EQ(actual.size(), expected.size());
+	ASSERT_TRUE(actual == expected);
+	ASSERT_EQ(driver_disconnect(), kSuccess);
+}
+
+TEST(AzureDriverTest, ReadMultipartFileWithoutCommonHeader)
+{
+	const std::string directory = "http://127.0.0.1:10000/devstoreaccount1/data-test-khiops-driver-azure/khiops_data/split/Adult/";
+	const long long file_size = 5634411;
+
+	ASSERT_EQ(driver_connect(), kSuccess);
+
+	// only the first part has the header: the parts are concatenated whole
+	std::string expected;
+	for (int part = 0; part <= 5; part++)
+	{
+		const std::string filename = directory + "Adult-split-0" + std::to_string(part) + ".txt";
+		const long long part_size = driver_getFileSize(filename.c_str());
+		ASSERT_GT(part_size, 0);
+		std::string content(static_cast<size_t>(part_size), '\0');
+		void* stream = driver_fopen(filename.c_str(), 'r');
+		ASSERT_NE(stream, nullptr);
+		ASSERT_EQ(driver_fread(&content[0], sizeof(char), content.size(), stream), part_size);
+		ASSERT_EQ(driver_fclose(stream), 0);
+		expected += content;
+	}
+	ASSERT_EQ((long long)expected.size(), file_size);
+
+	const std::string pattern = directory + "Adult-split-0[0-5].txt";
+	ASSERT_EQ(driver_getFileSize(pattern.c_str()), file_size);
+	void* stream = driver_fopen(pattern.c_str(), 'r');
+	ASSERT_NE(stream, nullptr);
+	std::string actual(expected.size(), '\0');
+	ASSERT_EQ(driver_fread(&actual[0], sizeof(char), actual.size(), stream), file_size);
+	ASSERT_EQ(driver_fclose(stream), 0);
+	ASSERT_TRUE(actual == expected);
+
+	ASSERT_EQ(driver_disconnect(), kSuccess);
+}
+
+TEST(AzureDriverTest, ReadSingleFileStreaming)
+{
+	const char* filename = "http://127.0.0.1:10000/devstoreaccount1/data-test-khiops-driver-azure/khiops_data/samples/Adult/Adult.txt";
+
+	ASSERT_EQ(driver_connect(), kSuccess);
+	std::vector<char> expected(300000);
+	void* stream = driver_fopen(filename, 'r');
+	ASSERT_NE(stream, nullptr);
+	ASSERT_EQ(driver_fread(expected.data(), sizeof(char), expected.size(), stream), (long long)expected.size());
+	ASSERT_EQ(driver_fclose(stream), 0);
+	ASSERT_EQ(driver_disconnect(), kSuccess);
+
+	auto env = boost::this_process::environment();
+	env["AZURE_DRIVER_STREAMING_READ"] = "1";
+	ASSERT_EQ(driver_connect(), kSuccess);
+	stream = driver_fopen(filename, 'r');
+	ASSERT_NE(stream, nullptr);
+
+	// consecutive reads from the same download, then from a new one after a seek
+	std::vector<char> buffer(expected.size());
+	for (size_t pos = 0; pos < buffer.size(); pos += 100000)
+	{
+		ASSERT_EQ(driver_fread(buffer.data() + pos, sizeof(char), 100000, stream), 100000);
+	}
+	ASSERT_EQ(buffer, expected);
+	ASSERT_EQ(driver_fseek(stream, 1000, SEEK_SET), 0);
+	ASSERT_EQ(driver_fread(buffer.data(), sizeof(char), 5000, stream), 5000);
+	ASSERT_TRUE(std::equal(buffer.begin(), buffer.begin() + 5000, expected.begin() + 1000));
+
+	ASSERT_EQ(driver_fseek(stream, 5585568 - 3, SEEK_SET), 0);
+	ASSERT_EQ(driver_fread(buffer.data(), sizeof(char), 5, stream), 3);
+
+	ASSERT_EQ(driver_fclose(stream), 0);
+	ASSERT_EQ(driver_disconnect(), kSuccess);
+	env.erase("AZURE_DRIVER_STREAMING_READ");
+}
+
+TEST(AzureDriverTest, ReadSplitIntoParallelRanges)
+{
+	const std::string directory = "http://127.0.0.1:10000/devstoreaccount1/data-test-khiops-driver-azure/khiops_data/output/"
+		+ boost::uuids::to_string(boost::uuids::random_generator()()) + "/";
+	const std::string header = "Label\tValue\n";
+
+	// two parts sharing the header, large enough for a read of both to be split in several ranges
+	std::vector<std::string> bodies(2);
+	for (size_t part = 0; part < bodies.size(); part++)
+	{
+		for (int i = 0; bodies[part].size() < 10 * 1024 * 1024; i++)
+		{
+			bodies[part] += "part" + std::to_string(part) + "\t" + std::to_string(i) + "\n";
+		}
+	}
+	const std::string expected = header + bodies[0] + bodies[1];
+
+	ASSERT_EQ(driver_connect(), kSuccess);
+	for (size_t part = 0; part < bodies.size(); part++)
+	{
+		const std::string filename = directory + "part-" + std::to_string(part) + ".txt";
+		const std::string content = header + bodies[part];
+		void* stream = driver_fopen(filename.c_str(), 'w');
+		ASSERT_NE(stream, nullptr);
+		ASSERT_EQ(driver_fwrite(content.data(), sizeof(char), content.size(), stream), (long long)content.size());
+		ASSERT_EQ(driver_fclose(stream), 0);
+	}
+	ASSERT_EQ(driver_disconnect(), kSuccess);
+
+	auto env = boost::this_process::environment();
+	env["AZURE_DRIVER_PARALLEL_READ_THRESHOLD"] = std::to_string(1024 * 1024);
+	ASSERT_EQ(driver_connect(), kSuccess);
+
+	// a single read of the whole file, one of its ranges crossing from the first part to the second
+	const std::string pattern = directory + "part-*.txt";
+	ASSERT_EQ(driver_getFileSize(pattern.c_str()), (long long)expected.size());
+	void* stream = driver_fopen(pattern.c_str(), 'r');
+	ASSERT_NE(stream, nullptr);
+	std::string read_back(expected.size(), '\0');
+	ASSERT_EQ(driver_fread(&read_back[0], sizeof(char), read_back.size(), stream), (long long)expected.size());
+	ASSERT_EQ(driver_fclose(stream), 0);
+	ASSERT_TRUE(read_back == expected);
+
+	ASSERT_EQ(driver_remove(pattern.c_str()), kSuccess);
+	ASSERT_EQ(driver_disconnect(), kSuccess);
+	env.erase("AZURE_DRIVER_PARALLEL_READ_THRESHOLD");
+}
+
+TEST(AzureDriverTest, ClosedStreamIsRejected)
+{
+	const char* filename = "http://127.0.0.1:10000/devstoreaccount1/data-test-khiops-driver-azure/khiops_data/samples/Adult/Adult.txt";
+
+	ASSERT_EQ(driver_connect(), kSuccess);
+	void* closed = driver_fopen(filename, 'r');
+	ASSERT_NE(closed, nullptr);
+	ASSERT_EQ(driver_fclose(closed), 0);
+
+	// the slot of the closed stream is reused, the old handle must not reach the new stream
+	void* stream = driver_fopen(filename, 'r');
+	ASSERT_NE(stream, nullptr);
+	ASSERT_NE(stream, closed);
+
+	char buffer[5];
+	ASSERT_EQ(driver_fread(buffer, sizeof(char), 5, closed), -1);
+	ASSERT_EQ(driver_fclose(closed), -1);
+	ASSERT_EQ(driver_fread(buffer, sizeof(char), 5, stream), 5);
+	ASSERT_EQ(driver_fclose(stream), 0);
+	ASSERT_EQ(driver_disconnect(), kSuccess);
+}
+
+TEST(AzureDriverTest, ConcurrentStreams)
+{
+	const char* filename = "http://127.0.0.1:10000/devstoreaccount1/data-test-khiops-driver-azure/khiops_data/samples/Adult/Adult.txt";
+
+	ASSERT_EQ(driver_connect(), kSuccess);
+	std::atomic<int> full_reads{0};
+	std::vector<std::thread> threads;
+	for (int t = 0; t < 8; t++)
+	{
+		threads.emplace_back([filename, t, &full_reads]()
+		{
+			void* stream = driver_fopen(filename, 'r');
+			if (!stream)
+			{
+				return;
+			}
+			std::vector<char> buffer(100000);
+			if (driver_fseek(stream, t * 1000, SEEK_SET) == 0
+				&& driver_fread(buffer.data(), sizeof(char), buffer.size(), stream) == (long long)buffer.size())
+			{
+				full_reads++;
+			}
+			driver_fclose(stream);
+		});
+	}
+	for (auto& thread : threads)
+	{
+		thread.join();
+	}
+	ASSERT_EQ(full_reads, 8);
+	ASSERT_EQ(driver_disconnect(), kSuccess);
+}
+
+TEST(AzureDriverTest, CopyToLocal)
+{
+	const std::string local_file = boost::uuids::to_string(boost::uuids::random_generator()()) + ".txt";
+
+	ASSERT_EQ(driver_connect(), kSuccess);
+	ASSERT_EQ(driver_copyToLocal("http://127.0.0.1:10000/devstoreaccount1/data-test-khiops-driver-azure/khiops_data/samples/Adult/Adult.txt", local_file.c_str()), kSuccess);
+	ASSERT_EQ(driver_disconnect(), kSuccess);
+
+	std::ifstream copied(local_file, std::ios::binary | std::ios::ate);
+	ASSERT_TRUE(copied.is_open());
+	ASSERT_EQ(static_cast<long long>(copied.tellg()), 5585568);
+	copied.close();
+	std::remove(local_file.c_str());
+}
+
+TEST(AzureDriverTest, CopyFromLocal)
+{
+	const std::string name = boost::uuids::to_string(boost::uuids::random_generator()()) + ".txt";
+	const std::string remote_file = "http://127.0.0.1:10000/devstoreaccount1/data-test-khiops-driver-azure/khiops_data/output/" + name;
+
+	// several blocks
+	const std::string content(20 * 1024 * 1024 + 1, 'k');
+	{
+		std::ofstream local(name, std::ios::binary);
+		local << content;
+	}
+
+	ASSERT_EQ(driver_connect(), kSuccess);
+	ASSERT_EQ(driver_copyFromLocal(name.c_str(), remote_file.c_str()), kSuccess);
+	ASSERT_EQ(driver_getFileSize(remote_file.c_str()), (long long)content.size());
+	ASSERT_EQ(driver_remove(remote_file.c_str()), kSuccess);
+	ASSERT_EQ(driver_disconnect(), kSuccess);
+	std::remove(name.c_str());
+}
+
+TEST(AzureDriverTest, WriteThenReadFile)
+{
+	const std::string filename = "http://127.0.0.1:10000/devstoreaccount1/data-test-khiops-driver-azure/khiops_data/output/"
+		+ boost::uuids::to_string(boost::uuids::random_generator()()) + ".txt";
+
+	// larger than a block, written in pieces that do not align on blocks
+	std::string content;
+	for (int i = 0; content.size() < 20 * 1024 * 1024; i++)
+	{
+		content += "line " + std::to_string(i) + "\n";
+	}
+
+	ASSERT_EQ(driver_connect(), kSuccess);
+	void* stream = driver_fopen(filename.c_str(), 'w');
+	ASSERT_NE(stream, nullptr);
+	const size_t step = 1000003;
+	for (size_t pos = 0; pos < content.size(); pos += step)
+	{
+		const size_t to_write = std::min(step, content.size() - pos);
+		ASSERT_EQ(driver_fwrite(content.data() + pos, sizeof(char), to_write, stream), (long long)to_write);
+	}
+	ASSERT_EQ(driver_fflush(stream), 0);
+	ASSERT_EQ(driver_fclose(stream), 0);
+
+	ASSERT_EQ(driver_getFileSize(filename.c_str()), (long long)content.size());
+	stream = driver_fopen(filename.c_str(), 'r');
+	ASSERT_NE(stream, nullptr);
+	std::string read_back(content.size(), '\0');
+	ASSERT_EQ(driver_fread(&read_back[0], sizeof(char), read_back.size(), stream), (long long)content.size());
+	ASSERT_EQ(driver_fclose(stream), 0);
+	ASSERT_EQ(read_back, content);
+
+	ASSERT_EQ(driver_remove(filename.c_str()), kSuccess);
+	ASSERT_EQ(driver_disconnect(), kSuccess);
+}
+
+// The storage emulator has no file service: the test runs against the directory of a file share given as
+// https://<account>.file.core.windows.net/<share>/<directory>/ in AZURE_DRIVER_TEST_SHARE_DIR
+TEST(AzureDriverTest, WriteThenReadShareFile)
+{
+	const char* share_dir = std::getenv("AZURE_DRIVER_TEST_SHARE_DIR");
+	if (!share_dir || !*share_dir)
+	{
+		GTEST_SKIP() << "AZURE_DRIVER_TEST_SHARE_DIR is not set";
+	}
+	const std::string filename = std::string(share_dir) + boost::uuids::to_string(boost::uuids::random_generator()()) + ".txt";
+
+	std::string content;
+	for (int i = 0; content.size() < 10 * 1024 * 1024; i++)
+	{
+		content += "line " + std::to_string(i) + "\n";
+	}
+
+	ASSERT_EQ(driver_connect(), kSuccess);
+	void* stream = driver_fopen(filename.c_str(), 'w');
+	ASSERT_NE(stream, nullptr);
+	const size_t step = 1000003;
+	for (size_t pos = 0; pos < content.size(); pos += step)
+	{
+		const size_t to_write = std::min(step, content.size() - pos);
+		ASSERT_EQ(driver_fwrite(content.data() + pos, sizeof(char), to_write, stream), (long long)to_write);
+	}
+	ASSERT_EQ(driver_fclose(stream), 0);
+
+	ASSERT_EQ(driver_getFileSize(filename.c_str()), (long long)content.size());
+	stream = driver_fopen(filename.c_str(), 'r');
+	ASSERT_NE(stream, nullptr);
+	std::string read_back(content.size(), '\0');
+	ASSERT_EQ(driver_fread(&read_back[0], sizeof(char), read_back.size(), stream), (long long)content.size());
+	ASSERT_EQ(driver_fclose(stream), 0);
+	ASSERT_EQ(read_back, content);
+
+	ASSERT_EQ(driver_remove(filename.c_str()), kSuccess);
+	ASSERT_EQ(driver_fileExists(filename.c_str()), kFalse);
+	ASSERT_EQ(driver_disconnect(), kSuccess);
+}
+
+TEST(AzureDriverTest, AppendToFile)
+{
+	const std::string filename = "http://127.0.0.1:10000/devstoreaccount1/data-test-khiops-driver-azure/khiops_data/output/"
+		+ boost::uuids::to_string(boost::uuids::random_generator()()) + ".txt";
+
+	ASSERT_EQ(driver_connect(), kSuccess);
+	for (const char* part : { "first\n", "second\n", "third\n" })
+	{
+		void* stream = driver_fopen(filename.c_str(), 'a');
+		ASSERT_NE(stream, nullptr);
+		ASSERT_EQ(driver_fwrite(part, sizeof(char), std::strlen(part), stream), (long long)std::strlen(part));
+		ASSERT_EQ(driver_fclose(stream), 0);
+	}
+
+	const std::string expected = "first\nsecond\nthird\n";
+	ASSERT_EQ(driver_getFileSize(filename.c_str()), (long long)expected.size());
+	void* stream = driver_fopen(filename.c_str(), 'r');
+	ASSERT_NE(stream, nullptr);
+	std::string read_back(expected.size(), '\0');
+	ASSERT_EQ(driver_fread(&read_back[0], sizeof(char), read_back.size(), stream), (long long)expected.size());
+	ASSERT_EQ(driver_fclose(stream), 0);
+	ASSERT_EQ(read_back, expected);
+
+	ASSERT_EQ(driver_remove(filename.c_str()), kSuccess);
+	ASSERT_EQ(driver_disconnect(), kSuccess);
+}
+
+TEST(AzureDriverTest, PartManifestLookup)
+{
+	std::vector<std::string> names;
+	std::vector<std::string> etags;
+	std::vector<long long> cumulative_sizes;
+	long long total = 0;
+	for (int i = 0; i < 1000; i++)
+	{
+		names.push_back("khiops_data/bq_export/part-" + std::to_string(100000 + i) + ".txt");
+		etags.push_back("\"0x8DC" + std::to_string(i * 7919) + "\"");
+		// some parts are empty
+		total += (i % 5 == 0) ? 0 : 1000 + i;
+		cumulative_sizes.push_back(total);
+	}
+
+	const PartManifest parts(names, cumulative_sizes, etags);
+	ASSERT_EQ(parts.Count(), names.size());
+	ASSERT_EQ(parts.TotalSize(), total);
+	for (size_t i = 0; i < names.size(); i++)
+	{
+		ASSERT_EQ(parts.Name(i), names[i]);
+		ASSERT_EQ(parts.ETag(i), etags[i]);
+		ASSERT_EQ(parts.PartSize(i), cumulative_sizes[i] - (i > 0 ? cumulative_sizes[i - 1] : 0));
+	}
+
+	for (long long offset = 0; offset < total; offset += 97)
+	{
+		long long part_start = -1;
+		const size_t part = parts.FindPart(offset, part_start);
+		const size_t expected = std::upper_bound(cumulative_sizes.begin(), cumulative_sizes.end(), offset) - cumulative_sizes.begin();
+		ASSERT_EQ(part, expected);
+		ASSERT_EQ(part_start, expected > 0 ? cumulative_sizes[expected - 1] : 0);
+	}
+	long long part_start = -1;
+	ASSERT_EQ(parts.FindPart(total, part_start), parts.Count());
+}
+
+TEST(AzureDriverTest, LatencyHistogramPercentiles)
+{
+	// buckets are exact for small values, then within 1/8 of the value
+	for (uint64_t value = 0; value < 16; value++)
+	{
+		ASSERT_EQ(LatencyHistogram::BucketLowerBound(LatencyHistogram::BucketIndex(value)), value);
+	}
+	for (uint64_t value = 16; value < 100000000000ULL; value = value * 3 + 1)
+	{
+		const uint64_t lower_bound = LatencyHistogram::BucketLowerBound(LatencyHistogram::BucketIndex(value));
+		ASSERT_LE(lower_bound, value);
+		ASSERT_LT(value - lower_bound, value / 8 + 1);
+	}
+	ASSERT_EQ(LatencyHistogram::BucketIndex(std::numeric_limits<uint64_t>::max()), LatencyHistogram::kBucketCount - 1);
+
+	LatencyHistogram histogram;
+	ASSERT_EQ(histogram.ValueAtPercentile(50), 0u);
+	for (uint64_t value = 1; value <= 1000; value++)
+	{
+		histogram.Record(value * 1000);
+	}
+	ASSERT_EQ(histogram.Count(), 1000u);
+	ASSERT_EQ(histogram.Max(), 1000000u);
+	ASSERT_EQ(histogram.Sum(), 500500000u);
+	ASSERT_GE(histogram.ValueAtPercentile(50), 500000u);
+	ASSERT_LE(histogram.ValueAtPercentile(50), 500000u * 9 / 8);
+	ASSERT_EQ(histogram.ValueAtPercentile(100), 1000000u);
+}
+
+TEST(AzureDriverTest, StatsDumpedAtDisconnect)
+{
+	const std::string stats_file = boost::uuids::to_string(boost::uuids::random_generator()()) + ".json";
+	auto env = boost::this_process::environment();
+	env["AZURE_DRIVER_STATS_FILE"] = stats_file;
+
+	ASSERT_EQ(driver_connect(), kSuccess);
+	ASSERT_EQ(driver_getFileSize("http://127.0.0.1:10000/devstoreaccount1/data-test-khiops-driver-azure/khiops_data/samples/Adult/Adult.txt"), 5585568);
+	ASSERT_EQ(driver_disconnect(), kSuccess);
+	env.erase("AZURE_DRIVER_STATS_FILE");
+
+	std::ifstream dumped(stats_file);
+	ASSERT_TRUE(dumped.is_open());
+	std::stringstream content;
+	content << dumped.rdbuf();
+	dumped.close();
+	std::remove(stats_file.c_str());
+
+	ASSERT_EQ(content.str().front(), '{');
+	ASSERT_NE(content.str().find("\"getFileSize\":{\"count\":"), std::string::npos);
+	ASSERT_NE(content.str().find("\"HEAD\":{\"count\":"), std::string::npos);
+	ASSERT_NE(content.str().find("\"http_retries\":"), std::string::npos);
+}
+
+TEST(AzureDriverTest, TraceWrittenAtDisconnect)
+{
+	const std::string trace_file = boost::uuids::to_string(boost::uuids::random_generator()()) + ".json";
+	auto env = boost::this_process::environment();
+	env["AZURE_DRIVER_TRACE_FILE"] = trace_file;
+
+	ASSERT_EQ(driver_connect(), kSuccess);
+	void* stream = driver_fopen("http://127.0.0.1:10000/devstoreaccount1/data-test-khiops-driver-azure/khiops_data/samples/Adult/Adult.txt", 'r');
+	ASSERT_NE(stream, nullptr);
+	char buffer[5];
+	ASSERT_EQ(driver_fread(buffer, sizeof(char), 5, stream), 5);
+	ASSERT_EQ(driver_fclose(stream), 0);
+	ASSERT_EQ(driver_disconnect(), kSuccess);
+	env.erase("AZURE_DRIVER_TRACE_FILE");
+
+	std::ifstream dumped(trace_file);
+	ASSERT_TRUE(dumped.is_open());
+	std::stringstream content;
+	content << dumped.rdbuf();
+	dumped.close();
+	std::remove(trace_file.c_str());
+
+	// the ranged read shows as a complete event of the handle that issued it
+	ASSERT_EQ(content.str().find("{\"displayTimeUnit\":\"ms\",\"traceEvents\":["), 0u);
+	ASSERT_NE(content.str().find("\"name\":\"GET\""), std::string::npos);
+	ASSERT_NE(content.str().find("\"range\":"), std::string::npos);
+	ASSERT_NE(content.str().find("\"first_byte_us\":"), std::string::npos);
+}
+
+TEST(AzureDriverTest, GetStatsWhileReading)
+{
+	ASSERT_EQ(driver_connect(), kSuccess);
+	void* stream = driver_fopen("http://127.0.0.1:10000/devstoreaccount1/data-test-khiops-driver-azure/khiops_data/samples/Adult/Adult.txt", 'r');
+	ASSERT_NE(stream, nullptr);
+	char buffer[5];
+	ASSERT_EQ(driver_fread(buffer, sizeof(char), 5, stream), 5);
+
+	// a live snapshot, taken with the stream still open
+	const std::string snapshot = driver_getStats();
+	ASSERT_EQ(snapshot.front(), '{');
+	ASSERT_EQ(snapshot.back(), '}');
+	ASSERT_NE(snapshot.find("\"fread\":{\"count\":"), std::string::npos);
+	ASSERT_NE(snapshot.find("\"bytes_read\":"), std::string::npos);
+
+	ASSERT_EQ(driver_fclose(stream), 0);
+	ASSERT_EQ(driver_disconnect(), kSuccess);
+}
+
+TEST(AzureDriverTest, MultipartFileFollowsNewParts)
+{
+	const std::string dirname = "http://127.0.0.1:10000/devstoreaccount1/data-test-khiops-driver-azure/khiops_data/output/"
+		+ boost::uuids::to_string(boost::uuids::random_generator()()) + "/";
+	const std::string pattern = dirname + "part-*.txt";
+	const std::string part = "header\nrow\n";
+
+	ASSERT_EQ(driver_connect(), kSuccess);
+	for (int i = 0; i < 3; i++)
+	{
+		const std::string filename = dirname + "part-" + std::to_string(i) + ".txt";
+		void* stream = driver_fopen(filename.c_str(), 'w');
+		ASSERT_NE(stream, nullptr);
+		ASSERT_EQ(driver_fwrite(part.data(), sizeof(char), part.size(), stream), (long long)part.size());
+		ASSERT_EQ(driver_fclose(stream), 0);
+
+		// the header is counted once, the manifest of the pattern is refreshed by each write
+		ASSERT_EQ(driver_getFileSize(pattern.c_str()), (long long)(part.size() + i * std::strlen("row\n")));
+		ASSERT_EQ(driver_getFileSize(pattern.c_str()), (long long)(part.size() + i * std::strlen("row\n")));
+	}
+
+	for (int i = 0; i < 3; i++)
+	{
+		ASSERT_EQ(driver_remove((dirname + "part-" + std::to_string(i) + ".txt").c_str()), kSuccess);
+	}
+	ASSERT_EQ(driver_getFileSize(pattern.c_str()), -1);
+	ASSERT_EQ(driver_disconnect(), kSuccess);
+}
+
 #ifndef _WIN32
 // Setting of environment variables does not work on Windows
 TEST(AzureDriverTest, DriverConnectMissingCredentialsFailure)
@@ -116,6 +708,74 @@ TEST(AzureDriverTest, DriverConnectMissingCredentialsFailure)
     env.erase("GCP_TOKEN");
 }
 
+std::vector<std::string> ListBlockFiles(const std::string& directory, long long& total_size)
+{
+	std::vector<std::string> names;
+	total_size = 0;
+	DIR* dir = opendir(directory.c_str());
+	for (struct dirent* item = dir ? readdir(dir) : nullptr; item; item = readdir(dir))
+	{
+		const std::string name = item->d_name;
+		struct stat file_stat;
+		if (name.size() > 6 && name.compare(name.size() - 6, 6, ".block") == 0 && stat((directory + "/" + name).c_str(), &file_stat) == 0)
+		{
+			names.push_back(name);
+			total_size += file_stat.st_size;
+		}
+	}
+	if (dir)
+	{
+		closedir(dir);
+	}
+	return names;
+}
+
+TEST(AzureDriverTest, DiskCacheWithinBudget)
+{
+	const char* filename = "http://127.0.0.1:10000/devstoreaccount1/data-test-khiops-driver-azure/khiops_data/samples/Adult/Adult.txt";
+	char dir_template[] = "/tmp/khiops-disk-cache-XXXXXX";
+	ASSERT_NE(mkdtemp(dir_template), nullptr);
+	const std::string cache_dir = dir_template;
+
+	auto env = boost::this_process::environment();
+	env["AZURE_DRIVER_DISK_CACHE_DIR"] = cache_dir;
+	env["AZURE_DRIVER_DISK_CACHE_SIZE"] = std::to_string(2 * 1024 * 1024);
+	env["AZURE_DRIVER_BLOCK_CACHE_BLOCK_SIZE"] = std::to_string(1024 * 1024);
+	env["AZURE_DRIVER_BLOCK_CACHE_SIZE"] = "0";
+
+	// the second connection reads the blocks left by the first one
+	std::vector<std::string> reads;
+	for (int connection = 0; connection < 2; connection++)
+	{
+		ASSERT_EQ(driver_connect(), kSuccess);
+		void* stream = driver_fopen(filename, 'r');
+		ASSERT_NE(stream, nullptr);
+		std::string content(5585568, '\0');
+		ASSERT_EQ(driver_fread(&content[0], sizeof(char), 100000, stream), 100000);
+		ASSERT_EQ(driver_fseek(stream, 4000000, SEEK_SET), 0);
+		ASSERT_EQ(driver_fread(&content[4000000], sizeof(char), 100000, stream), 100000);
+		ASSERT_EQ(driver_fclose(stream), 0);
+		ASSERT_EQ(driver_disconnect(), kSuccess);
+		reads.push_back(content);
+
+		long long cached_size = 0;
+		ASSERT_FALSE(ListBlockFiles(cache_dir, cached_size).empty());
+		ASSERT_LE(cached_size, 2 * 1024 * 1024);
+	}
+	ASSERT_EQ(reads[0], reads[1]);
+
+	env.erase("AZURE_DRIVER_DISK_CACHE_DIR");
+	env.erase("AZURE_DRIVER_DISK_CACHE_SIZE");
+	env.erase("AZURE_DRIVER_BLOCK_CACHE_BLOCK_SIZE");
+	env.erase("AZURE_DRIVER_BLOCK_CACHE_SIZE");
+	long long cached_size = 0;
+	for (const auto& name : ListBlockFiles(cache_dir, cached_size))
+	{
+		std::remove((cache_dir + "/" + name).c_str());
+	}
+	rmdir(cache_dir.c_str());
+}
+
 void setup_bad_credentials() {
     std::stringstream tempCredsFile;
 #ifdef _WIN32
@@ -148,8 +808,30 @@ TEST(AzureDriverTest, GetFileSizeInvalidCredentialsFailure)
 
 TEST(AzureDriverTest, RmDir)
 {
+	const std::string dirname = "http://127.0.0.1:10000/devstoreaccount1/data-test-khiops-driver-azure/khiops_data/output/"
+		+ boost::uuids::to_string(boost::uuids::random_generator()()) + "/";
+
     ASSERT_EQ(driver_connect(), kSuccess);
-	ASSERT_EQ(driver_rmdir("dummy"), kSuccess);
+	for (const char* name : { "a.txt", "b.csv", "sub/c.txt" })
+	{
+		void* stream = driver_fopen((dirname + name).c_str(), 'w');
+		ASSERT_NE(stream, nullptr);
+		ASSERT_EQ(driver_fwrite("x", sizeof(char), 1, stream), 1);
+		ASSERT_EQ(driver_fclose(stream), 0);
+	}
+
+	// a pattern removes the matching files only
+	ASSERT_EQ(driver_remove((dirname + "*.csv").c_str()), kSuccess);
+	ASSERT_EQ(driver_fileExists((dirname + "b.csv").c_str()), kFalse);
+	ASSERT_EQ(driver_fileExists((dirname + "a.txt").c_str()), kTrue);
+
+	// the directory goes with everything below it
+	ASSERT_EQ(driver_rmdir(dirname.c_str()), kSuccess);
+	ASSERT_EQ(driver_fileExists((dirname + "a.txt").c_str()), kFalse);
+	ASSERT_EQ(driver_fileExists((dirname + "sub/c.txt").c_str()), kFalse);
+	ASSERT_EQ(driver_dirExists(dirname.c_str()), kFalse);
+
+	ASSERT_EQ(driver_rmdir("dummy"), kFailure);
 	ASSERT_EQ(driver_disconnect(), kSuccess);
 }
 
@@ -160,6 +842,14 @@ TEST(AzureDriverTest, mkDir)
 	ASSERT_EQ(driver_disconnect(), kSuccess);
 }
 
+TEST(AzureDriverTest, DiskFreeSpace)
+{
+	ASSERT_EQ(driver_connect(), kSuccess);
+	ASSERT_EQ(driver_diskFreeSpace("http://127.0.0.1:10000/devstoreaccount1/data-test-khiops-driver-azure/khiops_data/output/"), 5LL * 1024LL * 1024LL * 1024LL * 1024LL);
+	ASSERT_EQ(driver_diskFreeSpace("dummy"), -1);
+	ASSERT_EQ(driver_disconnect(), kSuccess);
+}
+
 TEST(AzureDriverTest, GetSystemPreferredBufferSize)
 {
 	ASSERT_EQ(driver_getSystemPreferredBufferSize(), 4 * 1024 * 1024);